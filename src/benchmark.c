@@ -0,0 +1,189 @@
+#include "benchmark.h"
+
+// function that fills data with nPoints particles uniformly distributed in the domain, as done in main
+// seed : state of the random generator of the benchmark, see random_uniform
+void benchmark_fill(GLfloat(* data)[DATA_COLUMNS], int nPoints, double half_length, unsigned int* seed) {
+	for (int i = 0; i < nPoints; i++) {
+		for (int d = 0; d < DIMENSION; d++)
+			data[i][d] = random_uniform(seed) * 2.0 * half_length - half_length;
+		for (int d = 0; d < DIMENSION; d++)
+			data[i][DIMENSION + d] = random_uniform(seed) * 2.0 - 1.0;
+		for (int k = 2 * DIMENSION; k < DATA_COLUMNS; k++)
+			data[i][k] = 0.0f;
+	}
+}
+
+// function that gathers the positions of the neighbours of every particle, with the same memory accesses as the kernel
+// returns a value depending on every access so that the compiler can not remove the loop
+double benchmark_gather(neighborhood* nh, GLfloat(* data)[DATA_COLUMNS]) {
+	neighbours* list = &nh->list;
+	double sum = 0.0;
+	for (int i = 0; i < nh->nPoints; i++) {
+		for (int k = list->start[i]; k < list->start[i + 1]; k++) {
+			int j = list->index[k];
+			sum += (data[j][0] - data[i][0]) * (data[j][1] - data[i][1]);
+		}
+	}
+	return sum;
+}
+
+// function that returns the mean distance in the data table between a particle and its neighbours
+double benchmark_locality(neighborhood* nh) {
+	neighbours* list = &nh->list;
+	double sum = 0.0;
+	for (int i = 0; i < nh->nPoints; i++)
+		for (int k = list->start[i]; k < list->start[i + 1]; k++)
+			sum += abs(list->index[k] - i);
+	return list->size ? sum / list->size : 0.0;
+}
+
+void benchmark_reordering(int nPoints) {
+	GLfloat(*data)[DATA_COLUMNS] = malloc(sizeof(data[0]) * nPoints);
+	CHECK_MALLOC(data);
+	unsigned int seed = 0;
+	neighborhood_options* options = neighborhood_options_init(nPoints, 0.5, 1.0);
+	// the potential_list is not needed to measure the memory accesses
+	options->use_verlet = 0;
+	benchmark_fill(data, nPoints, options->half_length, &seed);
+	neighborhood* nh = options->nh;
+
+	for (int reordered = 0; reordered < 2; reordered++) {
+		clock_t begin = clock();
+		neighborhood_update(options, nh, data, 0);
+		double search_time = (double)(clock() - begin) / CLOCKS_PER_SEC;
+		begin = clock();
+		double sum = benchmark_gather(nh, data);
+		double gather_time = (double)(clock() - begin) / CLOCKS_PER_SEC;
+		printf("%s : search %.3f s, gather %.3f s, mean index distance to the neighbours %.0f (%g)\n",
+			reordered ? "Morton order" : "random order", search_time, gather_time, benchmark_locality(nh), sum);
+		if (!reordered)
+			neighborhood_reorder(options, nh, data);
+	}
+
+	neighborhood_options_delete(options, nh);
+	free(data);
+}
+
+void benchmark_filter(int nPoints) {
+	GLfloat(*data)[DATA_COLUMNS] = malloc(sizeof(data[0]) * nPoints);
+	CHECK_MALLOC(data);
+	unsigned int seed = 0;
+	neighborhood_options* options = neighborhood_options_init(nPoints, 0.5, 1.0);
+	// every search fills the lists again, with the half stencil of a single thread
+	options->use_verlet = 0;
+	options->use_half_stencil = 1;
+	options->nThreads = 1;
+	benchmark_fill(data, nPoints, options->half_length, &seed);
+	neighborhood* nh = options->nh;
+	neighborhood_update(options, nh, data, 0);
+	neighborhood_reorder(options, nh, data);
+
+	const char* names[] = { "no filter", "scalar filter", "AVX2 filter", "AVX-512 filter" };
+	for (simd_level level = SIMD_OFF; level <= neighborhood_simd_supported(); level++) {
+		options->simd = level;
+		int repetitions = 5;
+		clock_t begin = clock();
+		for (int r = 0; r < repetitions; r++)
+			neighborhood_update(options, nh, data, 0);
+		double search_time = (double)(clock() - begin) / CLOCKS_PER_SEC / repetitions;
+		printf("%s : search %.3f s, %d neighbours\n", names[level], search_time, nh->list.size);
+	}
+
+	neighborhood_options_delete(options, nh);
+	free(data);
+}
+
+void benchmark_subdivision(int nPoints) {
+	GLfloat(*data)[DATA_COLUMNS] = malloc(sizeof(data[0]) * nPoints);
+	CHECK_MALLOC(data);
+	unsigned int seed = 0;
+	neighborhood_options* options = neighborhood_options_init(nPoints, 0.5, 1.0);
+	// every search fills the lists again, with the half stencil of a single thread
+	options->use_verlet = 0;
+	options->use_half_stencil = 1;
+	options->nThreads = 1;
+	benchmark_fill(data, nPoints, options->half_length, &seed);
+	neighborhood* nh = options->nh;
+	neighborhood_update(options, nh, data, 0);
+	neighborhood_reorder(options, nh, data);
+
+	// the density of the neighbours is changed with the radius, from about twenty neighbours per particle to a few hundred
+	double kh = options->kh;
+	double scales[] = { 0.5, 1.0, 2.0 };
+	for (int k = 0; k < 3; k++) {
+		options->kh = kh * scales[k];
+		int best_subdivision = 1;
+		int best_skip = 0;
+		double best_time = 0.0;
+		for (int subdivision = 1; subdivision <= MAX_SUBDIVISION; subdivision++) {
+			for (int skip_corners = 0; skip_corners < 2; skip_corners++) {
+				options->subdivision = subdivision;
+				options->skip_corners = skip_corners;
+				int repetitions = 3;
+				clock_t begin = clock();
+				for (int r = 0; r < repetitions; r++)
+					neighborhood_update(options, nh, data, 0);
+				double search_time = (double)(clock() - begin) / CLOCKS_PER_SEC / repetitions;
+				printf("kh %.3f, %.1f neighbours per particle, subdivision %d%s : search %.3f s\n", options->kh,
+					(double)nh->list.size / nPoints, subdivision, skip_corners ? " without corners" : "", search_time);
+				if (best_time == 0.0 || search_time < best_time) {
+					best_time = search_time;
+					best_subdivision = subdivision;
+					best_skip = skip_corners;
+				}
+			}
+		}
+		printf("kh %.3f : best subdivision %d%s\n", options->kh, best_subdivision, best_skip ? " without corners" : "");
+	}
+
+	neighborhood_options_delete(options, nh);
+	free(data);
+}
+
+// function that runs the simulation of one instance of the benchmark of instances, with its own options, particles and random generator
+// returns the number of neighbours found at the last iteration
+int benchmark_instance(int nPoints, int nIterations, unsigned int seed) {
+	GLfloat(*data)[DATA_COLUMNS] = malloc(sizeof(data[0]) * nPoints);
+	CHECK_MALLOC(data);
+	double timestep = 0.5;
+	double maxspeed = 1.0;
+	neighborhood_options* options = neighborhood_options_init(nPoints, timestep, maxspeed);
+	// the threads are given to the instances instead of the search of each instance
+	options->nThreads = 1;
+	benchmark_fill(data, nPoints, options->half_length, &seed);
+	neighborhood* nh = options->nh;
+	for (int iterations = 0; iterations < nIterations; iterations++) {
+		if (iterations)
+			bouncyrandomupdate(data, options->nPoints, timestep, options->half_length, maxspeed, options->periodic, &seed);
+		neighborhood_update(options, nh, data, iterations);
+	}
+	int size = nh->list.size;
+	neighborhood_options_delete(options, nh);
+	free(data);
+	return size;
+}
+
+void benchmark_instances(int nInstances, int nPoints) {
+	int nIterations = 10;
+	int* sizes = malloc(2 * nInstances * sizeof(int));
+	CHECK_MALLOC(sizes);
+	for (int parallel = 0; parallel < 2; parallel++) {
+		int* parallel_sizes = sizes + parallel * nInstances;
+		double begin = wall_time();
+		if (parallel) {
+#pragma omp parallel for schedule(dynamic, 1)
+			for (int k = 0; k < nInstances; k++)
+				parallel_sizes[k] = benchmark_instance(nPoints, nIterations, k + 1);
+		}
+		else {
+			for (int k = 0; k < nInstances; k++)
+				parallel_sizes[k] = benchmark_instance(nPoints, nIterations, k + 1);
+		}
+		printf("%d instances of %d particles, %s : %.3f s\n", nInstances, nPoints, parallel ? "in parallel" : "one after the other", wall_time() - begin);
+	}
+	// each instance only depends on its seed, so that it finds the same neighbours whether it runs alone or with the others
+	for (int k = 0; k < nInstances; k++)
+		if (sizes[k] != sizes[nInstances + k])
+			printf("instance %d : %d neighbours alone, %d in parallel\n", k, sizes[k], sizes[nInstances + k]);
+	free(sizes);
+}
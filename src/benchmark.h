@@ -0,0 +1,28 @@
+#ifndef BENCHMARK_H
+#define BENCHMARK_H
+
+#include "neighborhood_search.h"
+
+// function that measures the effect of the reordering of the particles along a Morton curve on the memory accesses
+// the neighborhood search and a pass over the neighbours gathering their positions, as done in the kernel, are timed before and after the reordering
+// the mean distance in memory between a particle and its neighbours is printed as well, since it drives the number of cache misses
+// nPoints : number of particles of the benchmark
+void benchmark_reordering(int nPoints);
+
+// function that measures the cost of the search with each level of the distance filter supported by the processor, see cell_grid_filter
+// the particles are first sorted along a Morton curve, and the search is repeated with SIMD_OFF, then with every level up to the best supported one
+// nPoints : number of particles of the benchmark
+void benchmark_filter(int nPoints);
+
+// function that measures the cost of the search with each number of cells per search radius, with and without the corners of the stencil
+// the search is repeated for several radii, that is several mean numbers of neighbours, and the best subdivision is printed for each of them
+// nPoints : number of particles of the benchmark
+void benchmark_subdivision(int nPoints);
+
+// function that measures the cost of several independent simulations, run one after the other, then at the same time in one thread each
+// every instance has its own options, particles and random generator, and a search of a single thread
+// nInstances : number of simulations
+// nPoints : number of particles of each simulation
+void benchmark_instances(int nInstances, int nPoints);
+
+#endif
@@ -1,65 +1,108 @@
 #include "kernel.h"
 //#include "neighborhood_search_for_mac.h"
 #include <math.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 
 // Implementation of the kernel cubic function and return the weight regarding the distance and the radius of the circle
 
 
-void kernel(GLfloat(*data)[14], GLfloat(*coord)[2], neighborhood* nh, double kh) {
-    for (int i = 0; i < NPTS; i++) {
-        double val_node_x = data[i][8];
-        double val_node_y = data[i][9];
-        int nNeigh = nh[i].nNeighbours;
+void kernel(GLfloat(*data)[KERNEL_COLUMNS], GLfloat(*coord)[2], neighborhood* nh, double kh) {
+    for (int i = 0; i < nh->nPoints; i++) {
+        // the field of the particle has one component per axis, x, y and z in 3D
+        GLfloat* val_node = &data[i][KERNEL_FIELD];
         double val_div = 0;
-        double val_grad_x = 0;
-        double val_grad_y = 0;
+        double val_grad[DIMENSION] = { 0 };
         double val_lapl = 0;
         double dens2 = pow(DENSITY, 2);
-        neighbours* List = nh[i].list;
-        if (nNeigh > 0) {
-            for (int j = 0; j < nNeigh; j++) {
-                int index_node2 = List->index;
-                double distance = List->distance;
-                double d_x = data[index_node2][0] - data[i][0];
-                double d_y = data[index_node2][1] - data[i][1];
-                
-                /*
-                 You can choose here the desired kernel function for your code.
-                 */
-                
-                //double weight_x = grad_w_cubic(distance, kh, d_x);
-                //double weight_y = grad_w_cubic(distance, kh, d_y);
-                
-                double weight_x = grad_w_lucy(distance, kh, d_x);
-                double weight_y = grad_w_lucy(distance, kh, d_y);
-                
-                //double weight_x = grad_w_newquartic(distance, kh, d_x);
-                //double weight_y = grad_w_newquartic(distance, kh, d_y);
-                
-                //double weight_x = grad_w_quinticspline(distance, kh, d_x);
-                //double weight_y = grad_w_quinticspline(distance, kh, d_y);
-                
-                val_div += -MASS / DENSITY * ((data[index_node2][8] - val_node_x) * weight_x + (data[index_node2][9] - val_node_y) * weight_y);
-                val_grad_x += -DENSITY * MASS * ((val_node_x / dens2) + (data[index_node2][8] / dens2)) * weight_x;
-                val_grad_y += -DENSITY * MASS * ((val_node_x / dens2) + (data[index_node2][8] / dens2)) * weight_y;
-                val_lapl += 2.0 * MASS / DENSITY * (val_node_x - data[index_node2][8]) * (d_x * weight_x + d_y * weight_y) / pow(distance,2);
-                
-                List = List->next;
+        neighbours* List = &nh->list;
+        for (int k = List->start[i]; k < List->start[i + 1]; k++) {
+            int index_node2 = List->index[k];
+            GLfloat* val_node2 = &data[index_node2][KERNEL_FIELD];
+            double distance = List->distance[k];
+            // the displacement is stored by the search, so that the positions of the neighbours are not gathered again
+            double* d = List->displacement[k];
+            double weight[DIMENSION];
+            double dot = 0;
+            
+            /*
+             You can choose here the desired kernel function for your code.
+             */
+            
+            for (int a = 0; a < DIMENSION; a++) {
+                //weight[a] = grad_w_cubic(distance, kh, d[a]);
+                weight[a] = grad_w_lucy(distance, kh, d[a]);
+                //weight[a] = grad_w_newquartic(distance, kh, d[a]);
+                //weight[a] = grad_w_quinticspline(distance, kh, d[a]);
             }
+            
+            for (int a = 0; a < DIMENSION; a++) {
+                val_div += -MASS / DENSITY * (val_node2[a] - val_node[a]) * weight[a];
+                val_grad[a] += -DENSITY * MASS * ((val_node[0] / dens2) + (val_node2[0] / dens2)) * weight[a];
+                dot += d[a] * weight[a];
+            }
+            val_lapl += 2.0 * MASS / DENSITY * (val_node[0] - val_node2[0]) * dot / (distance * distance);
         }
         // All the values of the divergent gradient and laplacien are stored in the data table
-        data[i][10] = val_div;
-        data[i][11] = val_grad_x;
-        data[i][12] = val_grad_y;
-        data[i][13] = val_lapl;
+        data[i][KERNEL_DIVERGENCE] = val_div;
+        for (int a = 0; a < DIMENSION; a++)
+            data[i][KERNEL_GRADIENT + a] = val_grad[a];
+        data[i][KERNEL_LAPLACIAN] = val_lapl;
     }
     
     //Computation of the error based on the already know function.
-    for (int j = 0; j < NPTS; j++) {
+    for (int j = 0; j < nh->nPoints; j++) {
         double exact = 3 * pow(data[j][0], 2);
-        double error = exact - data[j][10];
+        double error = exact - data[j][KERNEL_DIVERGENCE];
+    }
+}
+
+// values of the particles used by kernel_pair
+// options : options of the search, giving the radius of each pair
+// sums : divergent, gradient along each axis and laplacien of each particle, accumulated in double precision as in kernel
+typedef struct kernel_values {
+    GLfloat(*data)[KERNEL_COLUMNS];
+    neighborhood_options* options;
+    double(*sums)[KERNEL_SUMS];
+} kernel_values;
+
+// same computation as the loop of kernel over the neighbours, for the particle i and its neighbour j, added to sums
+// displacement : position of j minus position of i
+// sums : divergent, gradient along each axis and laplacien, in the order of their columns from KERNEL_DIVERGENCE
+void kernel_terms(GLfloat(*data)[KERNEL_COLUMNS], double kh, int i, int j, double distance, const double displacement[DIMENSION], double sums[KERNEL_SUMS])
+{
+    GLfloat* val_node = &data[i][KERNEL_FIELD];
+    GLfloat* val_node2 = &data[j][KERNEL_FIELD];
+    double dens2 = DENSITY * DENSITY;
+    double dot = 0;
+    for (int a = 0; a < DIMENSION; a++) {
+        double weight = grad_w_lucy(distance, kh, displacement[a]);
+        sums[0] += -MASS / DENSITY * (val_node2[a] - val_node[a]) * weight;
+        sums[1 + a] += -DENSITY * MASS * ((val_node[0] / dens2) + (val_node2[0] / dens2)) * weight;
+        dot += displacement[a] * weight;
     }
+    sums[1 + DIMENSION] += 2.0 * MASS / DENSITY * (val_node[0] - val_node2[0]) * dot / (distance * distance);
+}
+
+// pair_visitor adding the terms of the pair (i,j) to the sums of i
+void kernel_pair(void* context, int i, int j, double distance, const double displacement[DIMENSION])
+{
+    kernel_values* values = context;
+    kernel_terms(values->data, pair_kh(values->options, i, j), i, j, distance, displacement, values->sums[i]);
+}
+
+void kernel_fused(neighborhood_options* options, GLfloat(*positions)[DATA_COLUMNS], GLfloat(*data)[KERNEL_COLUMNS])
+{
+    // the sums are kept in the neighborhoods of options, so that they are only allocated by the first call
+    size_t nSums = (size_t)options->nPoints * KERNEL_SUMS;
+    kernel_values values = { data, options, (double(*)[KERNEL_SUMS])neighborhood_sums_reserve(options->nh, nSums) };
+    memset(values.sums, 0, nSums * sizeof(double));
+    neighborhood_visit(options, positions, kernel_pair, &values);
+    for (int i = 0; i < options->nPoints; i++)
+        for (int k = 0; k < KERNEL_SUMS; k++)
+            data[i][KERNEL_DIVERGENCE + k] = values.sums[i][k];
 }
 
 /*
@@ -70,7 +113,11 @@ double grad_w_cubic(double distance, double kh, double d)
     double h = kh / 2;
     double q = distance / h;
     double weight = 0;
+#if DIMENSION == 3
+    double alpha_d = 3 / (2 * M_PI * pow(h, 3));
+#else
     double alpha_d = 15 / (7 * M_PI * pow(h, 2));
+#endif
     
     if (q > 0) {
         if (q <= 1) {
@@ -94,7 +141,11 @@ double grad_w_lucy(double distance, double kh, double d)
     double h = kh / 1;
     double q = distance / h;
     double grad_w = 0;
+#if DIMENSION == 3
+    double alpha_d = (105 / (16 * M_PI * pow(h, 3)));
+#else
     double alpha_d = (5 / (M_PI * pow(h, 2)));
+#endif
     if (q >= 0 && q <= 1)
     {
         grad_w = (-12.0 * q * alpha_d * pow((1 - q), 2)) * d /(pow(h,2) * q);
@@ -112,7 +163,11 @@ double grad_w_newquartic(double distance, double kh, double d)
     double h = kh / 2;
     double q = distance / h;
     double grad_w = 0;
+#if DIMENSION == 3
+    double alpha_d = (315 / (208 * M_PI * pow(h, 3)));
+#else
     double alpha_d = (15 / (7 * M_PI * pow(h, 2)));
+#endif
     if (q >= 0 && q <= 2)
     {
         grad_w = (alpha_d * (-(9.0 / 4.0) * q + (19.0 / 8.0) * pow(q, 2) - (5.0 / 8.0) * pow(q, 3)) * d) / (pow(h, 2) * q);
@@ -130,7 +185,11 @@ double grad_w_quinticspline(double distance, double kh, double d)
     double q = distance / h;
     double x_x, y_y;
     double grad_w = 0;
+#if DIMENSION == 3
+    double alpha_d = (1 / (120 * M_PI * pow(h, 3)));
+#else
     double alpha_d = (7 / (478 * M_PI * pow(h, 2)));
+#endif
     double dq = d / (h * distance);
     if (q >= 0 && q <= 1)
     {
@@ -151,6 +210,125 @@ double grad_w_quinticspline(double distance, double kh, double d)
     return  grad_w;
 }
 
+double w_cubic(double distance, double kh)
+{
+    double h = kh / 2;
+    double q = distance / h;
+#if DIMENSION == 3
+    double alpha_d = 3 / (2 * M_PI * pow(h, 3));
+#else
+    double alpha_d = 15 / (7 * M_PI * pow(h, 2));
+#endif
+    if (q <= 1)
+        return alpha_d * (2.0 / 3.0 - q * q + 0.5 * q * q * q);
+    if (q <= 2)
+        return alpha_d * (2 - q) * (2 - q) * (2 - q) / 6.0;
+    return 0.0;
+}
 
+double w_lucy(double distance, double kh)
+{
+    double h = kh / 1;
+    double q = distance / h;
+#if DIMENSION == 3
+    double alpha_d = (105 / (16 * M_PI * pow(h, 3)));
+#else
+    double alpha_d = (5 / (M_PI * pow(h, 2)));
+#endif
+    if (q <= 1)
+        return alpha_d * (1 + 3 * q) * (1 - q) * (1 - q) * (1 - q);
+    return 0.0;
+}
 
+double w_newquartic(double distance, double kh)
+{
+    double h = kh / 2;
+    double q = distance / h;
+#if DIMENSION == 3
+    double alpha_d = (315 / (208 * M_PI * pow(h, 3)));
+#else
+    double alpha_d = (15 / (7 * M_PI * pow(h, 2)));
+#endif
+    if (q <= 2)
+        return alpha_d * (2.0 / 3.0 - (9.0 / 8.0) * q * q + (19.0 / 24.0) * q * q * q - (5.0 / 32.0) * q * q * q * q);
+    return 0.0;
+}
+
+double w_quinticspline(double distance, double kh)
+{
+    double h = kh / 3;
+    double q = distance / h;
+#if DIMENSION == 3
+    double alpha_d = (1 / (120 * M_PI * pow(h, 3)));
+#else
+    double alpha_d = (7 / (478 * M_PI * pow(h, 2)));
+#endif
+    double w = 0;
+    if (q <= 3)
+        w += pow(3 - q, 5);
+    if (q <= 2)
+        w -= 6 * pow(2 - q, 5);
+    if (q <= 1)
+        w += 15 * pow(1 - q, 5);
+    return alpha_d * w;
+}
+
+void kernel_interpolate(neighborhood_options* options, neighborhood* probe_nh, GLfloat(*data)[DATA_COLUMNS], int column, double (*w)(double distance, double kh), double* values)
+{
+    neighbours* List = &probe_nh->list;
+    for (int p = 0; p < List->nRows; p++) {
+        double sum = 0;
+        double weights = 0;
+        for (int k = List->start[p]; k < List->start[p + 1]; k++) {
+            int index_node2 = List->index[k];
+            double kh = options->particle_kh ? options->particle_kh[index_node2] : options->kh;
+            double weight = MASS / DENSITY * w(List->distance[k], kh);
+            sum += weight * data[index_node2][column];
+            weights += weight;
+        }
+        // the sum is divided by the sum of the weights, so that a constant field is exact even near the boundaries
+        values[p] = weights > 0 ? sum / weights : 0.0;
+    }
+}
 
+void kernel_half(neighborhood_options* options, neighborhood* nh, GLfloat(*data)[KERNEL_COLUMNS])
+{
+    neighbours* List = &nh->half_list;
+    int nThreads = neighborhood_threads(options);
+    // each thread adds the terms of its pairs to its own sums, so that the particle j of a pair can be updated without any lock
+    // the sums are kept in nh, so that they are only allocated by the first call, then cleared by the threads
+    double(*sums)[KERNEL_SUMS] = (double(*)[KERNEL_SUMS])neighborhood_sums_reserve(nh, (size_t)nThreads * nh->nPoints * KERNEL_SUMS);
+#pragma omp parallel num_threads(nThreads)
+    {
+        int t = 0;
+#ifdef _OPENMP
+        t = omp_get_thread_num();
+#endif
+        double(*thread_sums)[KERNEL_SUMS] = sums + (size_t)t * nh->nPoints;
+        // the sums of the threads missing from a smaller team are cleared as well, since they are added like the other ones
+#pragma omp for schedule(static)
+        for (int u = 0; u < nThreads; u++)
+            memset(sums + (size_t)u * nh->nPoints, 0, nh->nPoints * sizeof(sums[0]));
+#pragma omp for schedule(dynamic, 256)
+        for (int i = 0; i < nh->nPoints; i++) {
+            for (int k = List->start[i]; k < List->start[i + 1]; k++) {
+                int j = List->index[k];
+                // the pair is weighted with the radius used by the search to find it, the same for both of its particles
+                double kh = pair_kh(options, i, j);
+                double reverse[DIMENSION];
+                for (int d = 0; d < DIMENSION; d++)
+                    reverse[d] = -List->displacement[k][d];
+                kernel_terms(data, kh, i, j, List->distance[k], List->displacement[k], thread_sums[i]);
+                kernel_terms(data, kh, j, i, List->distance[k], reverse, thread_sums[j]);
+            }
+        }
+#pragma omp for schedule(static)
+        for (int i = 0; i < nh->nPoints; i++)
+            for (int c = 0; c < KERNEL_SUMS; c++) {
+                double sum = 0;
+                for (int u = 0; u < nThreads; u++)
+                    sum += sums[(size_t)u * nh->nPoints + i][c];
+                data[i][KERNEL_DIVERGENCE + c] = sum;
+            }
+    }
+}
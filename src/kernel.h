@@ -11,43 +11,90 @@
 
 typedef struct neighborhood neighborhood;
 
+/*
+ Columns of the table used by the kernels, after the positions of the particles: the DIMENSION components of a vector field from KERNEL_FIELD,
+ then the divergence of this field, the DIMENSION components of the gradient of its first component and the laplacien of its first component.
+ In 2D, these are the columns 8 and 9, then 10, 11 and 12, and 13, in a table of 14 columns.
+ */
+#define KERNEL_FIELD 8
+#define KERNEL_DIVERGENCE (KERNEL_FIELD + DIMENSION)
+#define KERNEL_GRADIENT (KERNEL_DIVERGENCE + 1)
+#define KERNEL_LAPLACIAN (KERNEL_GRADIENT + DIMENSION)
+#define KERNEL_COLUMNS (KERNEL_LAPLACIAN + 1)
+#define KERNEL_SUMS (KERNEL_COLUMNS - KERNEL_DIVERGENCE)
+
 
 /*
  Implementation of the kernel function.
  It helps to compute the divergente, gradient and laplacien values.
+ Every pair is weighted with the radius kh: when options->particle_kh is set, kernel_fused and kernel_half use the radius of each pair instead.
  Input : table with all informations on every particles and their coordonates, object with each the neigbours of each particle stored as a list and the radius of the neighborhood.
  Output : update the divergente, gradient and laplacien of every nodes.
  */
-void kernel(GLfloat(*data)[14], GLfloat(*coord)[2], neighborhood* nh, double kh);
+void kernel(GLfloat(*data)[KERNEL_COLUMNS], GLfloat(*coord)[2], neighborhood* nh, double kh);
+
+/*
+ Same computation as kernel, in a single pass with neighborhood_visit instead of going through a table of neighbours.
+ Each pair is weighted with its radius given by pair_kh, as in the search: options->kh, or the combination of the radii of its particles when options->particle_kh is set.
+ Input : the options of the search with the radius of the neighborhood, the positions of the particles used by the search and the table with all informations on every particles.
+ Output : update the divergente, gradient and laplacien of every nodes, without storing any neighbour.
+ */
+void kernel_fused(neighborhood_options* options, GLfloat(*positions)[DATA_COLUMNS], GLfloat(*data)[KERNEL_COLUMNS]);
+
+/*
+ Same computation as kernel, with the half_list filled by the search when options->use_half_lists is set: the terms of both particles of a pair are computed from its single record.
+ Each pair is weighted with its radius given by pair_kh, as in kernel_fused.
+ Input : the options of the search with the radius of the neighborhood and the number of threads, the neighborhoods with their half_list and the table with all informations on every particles.
+ Output : update the divergente, gradient and laplacien of every nodes.
+ */
+void kernel_half(neighborhood_options* options, neighborhood* nh, GLfloat(*data)[KERNEL_COLUMNS]);
 
 
 /*
  Implementation of the gradient of the kernel cubic spline function
- Input : the distance between the particles, the radius of the neighborhood and the distance between particle in x or y direction regarding the desired weight
+ The normalisation constants of the kernels are the ones of the dimension DIMENSION chosen at compile time.
+ Input : the distance between the particles, the radius of the neighborhood and the distance between particle in x, y or z direction regarding the desired weight
  Output : the coefficient that represents the importance of each particles on the other particles.
  */
 double grad_w_cubic(double distance, double kh, double d);
 
 /*
  Implementation of the gradient of the kernel quintic spline function
- Input : the distance between the particles, the radius of the neighborhood and the distance between particle in x or y direction regarding the desired weight
+ Input : the distance between the particles, the radius of the neighborhood and the distance between particle in x, y or z direction regarding the desired weight
  Output : the coefficient that represents the importance of each particles on the other particles.
  */
 double grad_w_quinticspline(double distance, double kh, double d);
 
 /*
  Implementation of the gradient of the kernel new quartic spline function
- Input : the distance between the particles, the radius of the neighborhood and the distance between particle in x or y direction regarding the desired weight
+ Input : the distance between the particles, the radius of the neighborhood and the distance between particle in x, y or z direction regarding the desired weight
  Output : the coefficient that represents the importance of each particles on the other particles.
  */
 double grad_w_newquartic(double distance, double kh, double d);
 
 /*
  Implementation of the gradient of the Lucy quartic kernel function
- Input : the distance between the particles, the radius of the neighborhood and the distance between particle in x or y direction regarding the desired weight
+ Input : the distance between the particles, the radius of the neighborhood and the distance between particle in x, y or z direction regarding the desired weight
  Output : the coefficient that represents the importance of each particles on the other particles.
  */
 double grad_w_lucy(double distance, double kh, double d);
 
+/*
+ Implementation of the kernel functions whose gradients are given above, with the same radius and normalisation
+ Input : the distance between the particles and the radius of the neighborhood
+ Output : the weight of the particle
+ */
+double w_cubic(double distance, double kh);
+double w_quinticspline(double distance, double kh);
+double w_newquartic(double distance, double kh);
+double w_lucy(double distance, double kh);
+
+/*
+ Implementation of the interpolation of a field at probe points, with the neighbours found by neighborhood_probe.
+ Input : the options of the search, the neighborhoods of the probes, the table with all informations on every particles, the column of the field in this table and the chosen kernel function
+ Output : values, the field interpolated at every probe, 0 for the probes without any neighbour.
+ */
+void kernel_interpolate(neighborhood_options* options, neighborhood* probe_nh, GLfloat(*data)[DATA_COLUMNS], int column, double (*w)(double distance, double kh), double* values);
+
 
 #endif
@@ -1,6 +1,5 @@
 #include "neighborhood_search.h"
-
-int NPTS = 100;
+#include "benchmark.h"
 
 // for v, a floating point value between 0 and 1, this function fills color with
 // the improved jet colormap color corresponding to v
@@ -22,37 +21,48 @@ static void colormap(float v, float color[3])
 
 // function to fill the data table of the nPoints particles positions, speeds, colors and transparency and the coord table with the nPoints particles positions used to draw;
 // data[i][0] == coord[i][0] && data[i][1] == coord[i][1]
-void fillData(GLfloat(* data)[8])
+// seed : state of the random generator of the simulation, see random_uniform
+void fillData(GLfloat(* data)[DATA_COLUMNS], int nPoints, unsigned int* seed)
 {
-	float rmax = 100.0 * sqrtf(2.0f);
-	for (int i = 0; i < NPTS; i++) {
-		data[i][0] = rand() * 200.0 / RAND_MAX - 100.0; // x (rand between -100 and 100)
-		data[i][1] = rand() * 200.0 / RAND_MAX - 100.0; // y (rand between -100 and 100)
-		double r = sqrt(data[i][0] * data[i][0] + data[i][1] * data[i][1]);
-		data[i][2] = rand() * 2.0 / RAND_MAX - 1.0; //Random starting speed
-		data[i][3] = rand() * 2.0 / RAND_MAX - 1.0; //Random starting speed
-		colormap(r / rmax, &data[i][4]); // fill color
-		data[i][7] = 0.8f; // transparency
+	float rmax = 100.0 * sqrtf(DIMENSION);
+	for (int i = 0; i < nPoints; i++) {
+		double r = 0.0;
+		for (int d = 0; d < DIMENSION; d++) {
+			data[i][d] = random_uniform(seed) * 200.0 - 100.0; // x, y and z (rand between -100 and 100)
+			r += data[i][d] * data[i][d];
+		}
+		r = sqrt(r);
+		for (int d = 0; d < DIMENSION; d++)
+			data[i][DIMENSION + d] = random_uniform(seed) * 2.0 - 1.0; //Random starting speed
+		colormap(r / rmax, &data[i][2 * DIMENSION]); // fill color
+		data[i][2 * DIMENSION + 3] = 0.8f; // transparency
 	}
 }
 int main()
 {
-	GLfloat(*data)[8] = malloc(sizeof(data[0]) * NPTS);
+#ifdef BENCHMARK
+	benchmark_reordering(1000000);
+	benchmark_filter(1000000);
+	benchmark_subdivision(100000);
+	benchmark_instances(8, 100000);
+	return EXIT_SUCCESS;
+#endif
+	int nPoints = 100;
+	GLfloat(*data)[DATA_COLUMNS] = malloc(sizeof(data[0]) * nPoints);
 	CHECK_MALLOC(data);
 	// Seed the random
-	time_t seed = time(NULL);
+	unsigned int seed = (unsigned int)time(NULL);
 	//printf(" %u \n", seed);
-	srand(seed);
-	fillData(data);
+	fillData(data, nPoints, &seed);
 
 	double timestep = 0.5;
 	double maxspeed = 1;
-	neighborhood_options* options = neighborhood_options_init(timestep, maxspeed);
+	neighborhood_options* options = neighborhood_options_init(nPoints, timestep, maxspeed);
 	neighborhood* nh = options->nh;
 	int number_of_iterations = 10;
 	for (int iterations = 0; iterations < number_of_iterations;iterations++) {
 		if(iterations)
-			bouncyrandomupdate(data, timestep, options->half_length, maxspeed);
+			bouncyrandomupdate(data, options->nPoints, timestep, options->half_length, maxspeed, options->periodic, &seed);
 		neighborhood_update(options, nh, data, iterations);
 		//kernel(data, nh, kh);
 	}
@@ -1,168 +1,1516 @@
 #include "neighborhood_search.h"
 #include <math.h>
+#include <float.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+// the vector filters are compiled for their own instructions with the attributes of GCC and Clang, and chosen at runtime
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define USE_X86_SIMD
+#endif
 
 
-// Structure to represent a node of the linked list ResidentList of a cell, used to represent the particles contained in a cell
-// index : the index in the data table, supposed to be available everywhere it is needed
-// next : pointer to the next particle of the linked list
-typedef struct node {
-	int index;
-	struct node* next;
-}node;
-
-// Structure to represent a cell and the particles it contains
-// nResident : number of particles contained in the linked list ResidentList
-// ResidentList : linked list used to contain the index of the particles that are in the current cell
-typedef struct cell {
-	int nResident;
-	node* ResidentList;
-}cell;
-
-// function to create a neighbours to the neighborhood neigh[i] owned by the particles represented in data[i]
-// index : the index of the neighbours to be added
-// neigh : array of the neighborhood of the current iteration
-// i : index if the particles that owns the neighborhood to modify
-// d : distance between the particle in data[i] and the particle in data[index]
-// is_after : ensures that all the neighbours added in the potential_list are after the owner of the neighborhood to modify; necessary when using improved algorithm
-// is_potential : used to differentiate an actual neighbour and an only potential neighbour
-void neighbours_new(int index, neighborhood* neigh, int i, double d, int is_after, int is_potential)
-{
-	if (is_after) {
-		neighbours* newP = malloc(sizeof(neighbours));
-		CHECK_MALLOC(newP);
-		newP->index = index;
-		newP->distance = d;
-		newP->next = neigh[i].potential_list;
-		neigh[i].potential_list = newP;
-		neigh[i].nPotentialNeighbours++;
-	}
-	if (!is_potential) {
-		neighbours* new = malloc(sizeof(neighbours));
-		CHECK_MALLOC(new);
-		new->index = index;
-		new->distance = d;
-		new->next = neigh[i].list;
-		neigh[i].list = new;
-		neigh[i].nNeighbours++;
-	}
-}
-
-// function that frees the memory of a neighbour n passed as argument
+// function to make sure the pairs p can contain n pairs; the capacity is doubled to avoid reallocating at each call
+void pairs_reserve(neighbour_pairs* p, int n) {
+	if (n <= p->capacity)
+		return;
+	int capacity = p->capacity ? p->capacity : 1024;
+	while (capacity < n)
+		capacity *= 2;
+	p->owner = realloc(p->owner, capacity * sizeof(int));
+	CHECK_MALLOC(p->owner);
+	p->index = realloc(p->index, capacity * sizeof(int));
+	CHECK_MALLOC(p->index);
+	p->distance = realloc(p->distance, capacity * sizeof(double));
+	CHECK_MALLOC(p->distance);
+	p->displacement = realloc(p->displacement, capacity * sizeof(p->displacement[0]));
+	CHECK_MALLOC(p->displacement);
+	p->capacity = capacity;
+}
+
+// function to add the pair (owner, index) at the end of the pairs p
+// d : distance between the two particles
+// offset : position of index minus the position of owner
+void pairs_push(neighbour_pairs* p, int owner, int index, double d, const double offset[DIMENSION]) {
+	if (p->size == p->capacity)
+		pairs_reserve(p, p->size + 1);
+	p->owner[p->size] = owner;
+	p->index[p->size] = index;
+	p->distance[p->size] = d;
+	for (int k = 0; k < DIMENSION; k++)
+		p->displacement[p->size][k] = offset[k];
+	p->size++;
+}
+
+// function to add both the pair (i, j) and the pair (j, i) at the end of the pairs p, the second one with the opposite offset
+void pairs_push_both(neighbour_pairs* p, int i, int j, double d, const double offset[DIMENSION]) {
+	double opposite[DIMENSION];
+	for (int k = 0; k < DIMENSION; k++)
+		opposite[k] = -offset[k];
+	pairs_push(p, i, j, d, offset);
+	pairs_push(p, j, i, d, opposite);
+}
+
+// function to properly free the arrays of the pairs p
+void pairs_delete(neighbour_pairs* p) {
+	free(p->owner);
+	free(p->index);
+	free(p->distance);
+	free(p->displacement);
+}
+
+// function to fill the table n with the pairs p, sorted by owner with a counting sort
+// the arrays of n are only reallocated when p contains more pairs than ever before
+void neighbours_build(neighbours* n, neighbour_pairs* p) {
+	if (p->size > n->capacity) {
+		int capacity = n->capacity ? n->capacity : 1024;
+		while (capacity < p->size)
+			capacity *= 2;
+		n->index = realloc(n->index, capacity * sizeof(int));
+		CHECK_MALLOC(n->index);
+		n->distance = realloc(n->distance, capacity * sizeof(double));
+		CHECK_MALLOC(n->distance);
+		n->displacement = realloc(n->displacement, capacity * sizeof(n->displacement[0]));
+		CHECK_MALLOC(n->displacement);
+		n->capacity = capacity;
+	}
+	int* start = n->start;
+	memset(start, 0, (n->nRows + 1) * sizeof(int));
+	for (int k = 0; k < p->size; k++)
+		start[p->owner[k] + 1]++;
+	for (int i = 0; i < n->nRows; i++)
+		start[i + 1] += start[i];
+	// start[i] is used as the cursor of the row i, so that it ends up at the start of the row i+1
+	for (int k = 0; k < p->size; k++) {
+		int position = start[p->owner[k]]++;
+		n->index[position] = p->index[k];
+		n->distance[position] = p->distance[k];
+		for (int d = 0; d < DIMENSION; d++)
+			n->displacement[position][d] = p->displacement[k][d];
+	}
+	for (int i = n->nRows; i > 0; i--)
+		start[i] = start[i - 1];
+	start[0] = 0;
+	n->size = p->size;
+	p->size = 0;
+}
+
+// function to fill the table n with the pairs found by nThreads threads, each one in its own pairs p[t]
+// the pairs of one owner must all be found by the same thread and be contiguous in its pairs, so that each thread copies its rows without any lock
+void neighbours_merge(neighbours* n, neighbour_pairs* p, int nThreads) {
+	int total = 0;
+	for (int t = 0; t < nThreads; t++)
+		total += p[t].size;
+	if (total > n->capacity) {
+		int capacity = n->capacity ? n->capacity : 1024;
+		while (capacity < total)
+			capacity *= 2;
+		n->index = realloc(n->index, capacity * sizeof(int));
+		CHECK_MALLOC(n->index);
+		n->distance = realloc(n->distance, capacity * sizeof(double));
+		CHECK_MALLOC(n->distance);
+		n->displacement = realloc(n->displacement, capacity * sizeof(n->displacement[0]));
+		CHECK_MALLOC(n->displacement);
+		n->capacity = capacity;
+	}
+	int* start = n->start;
+	memset(start, 0, (n->nRows + 1) * sizeof(int));
+#pragma omp parallel num_threads(nThreads)
+	{
+#pragma omp for schedule(static, 1)
+		for (int t = 0; t < nThreads; t++)
+			for (int k = 0; k < p[t].size; k++)
+				start[p[t].owner[k] + 1]++;
+#pragma omp single
+		for (int i = 0; i < n->nRows; i++)
+			start[i + 1] += start[i];
+#pragma omp for schedule(static, 1)
+		for (int t = 0; t < nThreads; t++) {
+			int row_begin = 0;
+			for (int k = 0; k < p[t].size; k++) {
+				if (k == 0 || p[t].owner[k] != p[t].owner[k - 1])
+					row_begin = k;
+				int position = start[p[t].owner[k]] + k - row_begin;
+				n->index[position] = p[t].index[k];
+				n->distance[position] = p[t].distance[k];
+				for (int d = 0; d < DIMENSION; d++)
+					n->displacement[position][d] = p[t].displacement[k][d];
+			}
+			p[t].size = 0;
+		}
+	}
+	n->size = total;
+}
+
+// function to make sure the table n can contain capacity neighbours; the capacity is doubled to avoid reallocating at each call
+void neighbours_reserve(neighbours* n, int capacity) {
+	if (capacity <= n->capacity)
+		return;
+	int new_capacity = n->capacity ? n->capacity : 1024;
+	while (new_capacity < capacity)
+		new_capacity *= 2;
+	n->index = realloc(n->index, new_capacity * sizeof(int));
+	CHECK_MALLOC(n->index);
+	n->distance = realloc(n->distance, new_capacity * sizeof(double));
+	CHECK_MALLOC(n->distance);
+	n->displacement = realloc(n->displacement, new_capacity * sizeof(n->displacement[0]));
+	CHECK_MALLOC(n->displacement);
+	n->capacity = new_capacity;
+}
+
+// function that returns the number of particles the arrays of capacity particles must be able to contain to store nPoints particles;
+// the capacity is doubled, so that the particles added one at a time only reallocate the arrays a few times
+int particle_capacity(int capacity, int nPoints) {
+	if (nPoints <= capacity)
+		return capacity;
+	if (!capacity)
+		return nPoints;
+	while (capacity < nPoints)
+		capacity *= 2;
+	return capacity;
+}
+
+// function to give nRows rows to the table n, the new rows being empty and the rows after nRows being dropped
+// start is only reallocated when the table has more rows than ever before, with the capacity given by particle_capacity
+void neighbours_resize(neighbours* n, int nRows) {
+	if (nRows > n->rowCapacity) {
+		n->rowCapacity = particle_capacity(n->rowCapacity, nRows);
+		n->start = realloc(n->start, (n->rowCapacity + 1) * sizeof(int));
+		CHECK_MALLOC(n->start);
+	}
+	for (int i = n->nRows; i < nRows; i++)
+		n->start[i + 1] = n->start[i];
+	n->nRows = nRows;
+	n->size = n->start[nRows];
+}
+
+// function that fills the list of nh with both directions of each pair of its half_list, the rows being shared between nThreads threads
+// each thread counts the pairs of its own rows in every row of the list, so that it then writes them at its own positions without any
+// atomic operation, as in cell_grid_sort_parallel; the rows of a thread are before the ones of the next threads, so that each row of the list
+// has the pairs of its own row of the half_list, then the other pairs sorted by index, whatever the number of threads
+void neighborhood_transpose(neighborhood* nh, int nThreads) {
+	neighbours* half = &nh->half_list;
+	neighbours* full = &nh->list;
+	int nRows = half->nRows;
+	neighbours_reserve(full, 2 * half->size);
+	int* start = full->start;
+	// the counters of the threads are followed by the partial sums of the scan
+	size_t nCounts = (size_t)nThreads * nRows + nThreads + 1;
+	if (nCounts > nh->countCapacity) {
+		nh->threadCounts = realloc(nh->threadCounts, nCounts * sizeof(int));
+		CHECK_MALLOC(nh->threadCounts);
+		nh->countCapacity = nCounts;
+	}
+	int* blockSums = &nh->threadCounts[(size_t)nThreads * nRows];
+	int nTeam = 1;
+#pragma omp parallel num_threads(nThreads)
+	{
+		int t = 0;
+#ifdef _OPENMP
+		t = omp_get_thread_num();
+#pragma omp single
+		nTeam = omp_get_num_threads();
+#endif
+		int* counts = &nh->threadCounts[(size_t)t * nRows];
+		int begin = (int)((long long)nRows * t / nTeam);
+		int end = (int)((long long)nRows * (t + 1) / nTeam);
+		memset(counts, 0, nRows * sizeof(int));
+		for (int i = begin; i < end; i++)
+			for (int k = half->start[i]; k < half->start[i + 1]; k++)
+				counts[half->index[k]]++;
+#pragma omp barrier
+		int sum = 0;
+		for (int i = begin; i < end; i++) {
+			sum += half->start[i + 1] - half->start[i];
+			for (int u = 0; u < nTeam; u++)
+				sum += nh->threadCounts[(size_t)u * nRows + i];
+		}
+		blockSums[t + 1] = sum;
+#pragma omp barrier
+#pragma omp single
+		{
+			blockSums[0] = 0;
+			for (int u = 0; u < nTeam; u++)
+				blockSums[u + 1] += blockSums[u];
+		}
+		int position = blockSums[t];
+		for (int i = begin; i < end; i++) {
+			start[i] = position;
+			for (int k = half->start[i]; k < half->start[i + 1]; k++, position++) {
+				full->index[position] = half->index[k];
+				full->distance[position] = half->distance[k];
+				memcpy(full->displacement[position], half->displacement[k], sizeof(full->displacement[0]));
+			}
+			for (int u = 0; u < nTeam; u++) {
+				int* count = &nh->threadCounts[(size_t)u * nRows + i];
+				int pairs = *count;
+				*count = position;
+				position += pairs;
+			}
+		}
+#pragma omp barrier
+		for (int i = begin; i < end; i++) {
+			for (int k = half->start[i]; k < half->start[i + 1]; k++) {
+				int position = counts[half->index[k]]++;
+				full->index[position] = i;
+				full->distance[position] = half->distance[k];
+				for (int d = 0; d < DIMENSION; d++)
+					full->displacement[position][d] = -half->displacement[k][d];
+			}
+		}
+	}
+	start[nRows] = blockSums[nTeam];
+	full->size = 2 * half->size;
+}
+
+void neighbours_sort_pairs(neighbours* n, neighbours* source, int is_half, neighbour_pairs* p) {
+	pairs_reserve(p, source->size);
+	for (int i = 0; i < source->nRows; i++) {
+		for (int k = source->start[i]; k < source->start[i + 1]; k++) {
+			int j = source->index[k];
+			if (j > i)
+				pairs_push(p, i, j, source->distance[k], source->displacement[k]);
+			else if (is_half) {
+				// the displacement goes from the owner to its neighbour, so that it changes its sign with the owner
+				double reverse[DIMENSION];
+				for (int d = 0; d < DIMENSION; d++)
+					reverse[d] = -source->displacement[k][d];
+				pairs_push(p, j, i, source->distance[k], reverse);
+			}
+		}
+	}
+	neighbours_build(n, p);
+	// the rows are short, so that an insertion sort is enough
+	for (int i = 0; i < n->nRows; i++) {
+		for (int k = n->start[i] + 1; k < n->start[i + 1]; k++) {
+			int index = n->index[k];
+			double distance = n->distance[k];
+			double displacement[DIMENSION];
+			memcpy(displacement, n->displacement[k], sizeof(displacement));
+			int l = k;
+			for (; l > n->start[i] && n->index[l - 1] > index; l--) {
+				n->index[l] = n->index[l - 1];
+				n->distance[l] = n->distance[l - 1];
+				memcpy(n->displacement[l], n->displacement[l - 1], sizeof(displacement));
+			}
+			n->index[l] = index;
+			n->distance[l] = distance;
+			memcpy(n->displacement[l], displacement, sizeof(displacement));
+		}
+	}
+}
+
+// the pairs of the previous iteration are kept sorted in pair_list, so that both tables are merged row by row in a single pass
+void neighborhood_changes(neighborhood* nh, neighbours* source, int is_half) {
+	neighbours* current = &nh->pair_buffer;
+	neighbours_sort_pairs(current, source, is_half, &nh->list_pairs);
+	neighbours* previous = &nh->pair_list;
+	neighbour_pairs* added = &nh->added_pairs;
+	neighbour_pairs* removed = &nh->removed_pairs;
+	added->size = 0;
+	removed->size = 0;
+	for (int i = 0; i < current->nRows; i++) {
+		int a = previous->start[i];
+		int b = current->start[i];
+		while (a < previous->start[i + 1] || b < current->start[i + 1]) {
+			if (b == current->start[i + 1] || (a < previous->start[i + 1] && previous->index[a] < current->index[b])) {
+				pairs_push(removed, i, previous->index[a], previous->distance[a], previous->displacement[a]);
+				a++;
+			}
+			else if (a == previous->start[i + 1] || current->index[b] < previous->index[a]) {
+				pairs_push(added, i, current->index[b], current->distance[b], current->displacement[b]);
+				b++;
+			}
+			else {
+				a++;
+				b++;
+			}
+		}
+	}
+	neighbours swap = *previous;
+	*previous = *current;
+	*current = swap;
+}
+
+// function to give its own pairs to each of the nThreads threads that fill the neighborhoods nh
+void neighborhood_threads_reserve(neighborhood* nh, int nThreads) {
+	if (nThreads <= nh->nThreads)
+		return;
+	nh->thread_list_pairs = realloc(nh->thread_list_pairs, nThreads * sizeof(neighbour_pairs));
+	CHECK_MALLOC(nh->thread_list_pairs);
+	nh->thread_potential_pairs = realloc(nh->thread_potential_pairs, nThreads * sizeof(neighbour_pairs));
+	CHECK_MALLOC(nh->thread_potential_pairs);
+	for (int t = nh->nThreads; t < nThreads; t++) {
+		nh->thread_list_pairs[t] = (neighbour_pairs){ 0 };
+		nh->thread_potential_pairs[t] = (neighbour_pairs){ 0 };
+	}
+	nh->nThreads = nThreads;
+}
+
+// function to create an empty table of nRows rows
+void neighbours_init(neighbours* n, int nRows) {
+	n->nRows = nRows;
+	n->rowCapacity = nRows;
+	n->size = 0;
+	n->capacity = 0;
+	n->start = calloc(nRows + 1, sizeof(int));
+	CHECK_MALLOC(n->start);
+	n->index = NULL;
+	n->distance = NULL;
+	n->displacement = NULL;
+}
+
+// function that frees the memory of the table n passed as argument
 void neighbours_delete(neighbours* n) {
-	if (n) {
-		neighbours* temp = n->next;
-		free(n);
-		neighbours_delete(temp);
+	free(n->start);
+	free(n->index);
+	free(n->distance);
+	free(n->displacement);
+}
+
+// function that frees the arrays of the table n except start, so that it becomes empty and gets allocated again by the next build
+void neighbours_release(neighbours* n) {
+	free(n->index);
+	free(n->distance);
+	free(n->displacement);
+	n->index = NULL;
+	n->distance = NULL;
+	n->displacement = NULL;
+	n->size = 0;
+	n->capacity = 0;
+}
+
+// function that frees the arrays of the pairs p, so that they get allocated again by the next push
+void pairs_release(neighbour_pairs* p) {
+	pairs_delete(p);
+	*p = (neighbour_pairs){ 0 };
+}
+
+// function to fill the compact table c with the neighbours table n, whose distances are only kept when keep_distance is set
+// the arrays of c are only reallocated when they are too small
+void compact_neighbours_build(compact_neighbours* c, neighbours* n, int keep_distance) {
+	if (n->nRows > c->nRows) {
+		c->start = realloc(c->start, (n->nRows + 1) * sizeof(int));
+		CHECK_MALLOC(c->start);
+		c->wordStart = realloc(c->wordStart, (n->nRows + 1) * sizeof(int));
+		CHECK_MALLOC(c->wordStart);
+	}
+	c->nRows = n->nRows;
+	c->size = n->size;
+	// a neighbour needs a single word when its difference of index fits in it, and three words otherwise
+	int nWords = 0;
+	for (int i = 0; i < n->nRows; i++) {
+		c->start[i] = n->start[i];
+		c->wordStart[i] = nWords;
+		for (int k = n->start[i]; k < n->start[i + 1]; k++) {
+			int delta = n->index[k] - i;
+			nWords += delta > COMPACT_ESCAPE && delta <= -COMPACT_ESCAPE - 1 ? 1 : 3;
+		}
+	}
+	c->start[n->nRows] = n->size;
+	c->wordStart[n->nRows] = nWords;
+	if (nWords > c->wordCapacity) {
+		c->words = realloc(c->words, nWords * sizeof(short));
+		CHECK_MALLOC(c->words);
+		c->wordCapacity = nWords;
+	}
+	c->nWords = nWords;
+	int position = 0;
+	for (int i = 0; i < n->nRows; i++) {
+		for (int k = n->start[i]; k < n->start[i + 1]; k++) {
+			int delta = n->index[k] - i;
+			if (delta > COMPACT_ESCAPE && delta <= -COMPACT_ESCAPE - 1)
+				c->words[position++] = (short)delta;
+			else {
+				c->words[position++] = COMPACT_ESCAPE;
+				c->words[position++] = (short)(n->index[k] & 0xFFFF);
+				c->words[position++] = (short)(n->index[k] >> 16);
+			}
+		}
+	}
+	if (!keep_distance) {
+		free(c->distance);
+		c->distance = NULL;
+		c->distanceCapacity = 0;
+		return;
+	}
+	if (n->size > c->distanceCapacity) {
+		c->distance = realloc(c->distance, n->size * sizeof(float));
+		CHECK_MALLOC(c->distance);
+		c->distanceCapacity = n->size;
 	}
+	for (int k = 0; k < n->size; k++)
+		c->distance[k] = (float)n->distance[k];
 }
 
+// function that returns the neighbour of owner stored in words at *position, and moves position to the next neighbour
+int compact_neighbours_decode(const short* words, int* position, int owner) {
+	int delta = words[(*position)++];
+	if (delta != COMPACT_ESCAPE)
+		return owner + delta;
+	unsigned int low = (unsigned short)words[(*position)++];
+	unsigned int high = (unsigned short)words[(*position)++];
+	return (int)(low | high << 16);
+}
+
+// function to properly free the arrays of the compact table c
+void compact_neighbours_delete(compact_neighbours* c) {
+	free(c->start);
+	free(c->wordStart);
+	free(c->words);
+	free(c->distance);
+}
+
+// function that stores the potential_list of nh in its compact form, then frees the arrays of the potential_list and of the pairs used to fill it,
+// which are only allocated again by the next search
+void neighborhood_compact(neighborhood* nh) {
+	compact_neighbours_build(&nh->compact_potential, &nh->potential_list, 0);
+	neighbours_release(&nh->potential_list);
+	pairs_release(&nh->potential_pairs);
+	for (int t = 0; t < nh->nThreads; t++)
+		pairs_release(&nh->thread_potential_pairs[t]);
+	nh->is_compact = 1;
+}
+
+// function that fills the potential_list of nh again with its compact form, without the distances nor the displacements, which are set to 0
+void neighborhood_expand(neighborhood* nh) {
+	compact_neighbours* c = &nh->compact_potential;
+	double offset[DIMENSION] = { 0 };
+	pairs_reserve(&nh->potential_pairs, c->size);
+	for (int i = 0; i < c->nRows; i++) {
+		int position = c->wordStart[i];
+		for (int k = c->start[i]; k < c->start[i + 1]; k++)
+			pairs_push(&nh->potential_pairs, i, compact_neighbours_decode(c->words, &position, i), 0.0, offset);
+	}
+	neighbours_build(&nh->potential_list, &nh->potential_pairs);
+	nh->is_compact = 0;
+}
 
-// function to create neighborhoods
-// n : number of points, and so number of neighborhoods to create
-// previous : pointer to the neighborhoods of the previous iteration, used in the verlet algorithm to keep the same potential_list when this should not be updated
-neighborhood* neighborhood_new(neighborhood* previous, int iterations)
+neighborhood* neighborhood_new(int nPoints)
 {
-	for (int i = 0; i < NPTS; i++) {
-			previous[i].nNeighbours = 0;
-			neighbours_delete(previous[i].list);
-			previous[i].list = NULL;
-			if (!iterations) {
-				previous[i].index = i;
-				previous[i].nPotentialNeighbours = 0;
-				neighbours_delete(previous[i].potential_list);
-				previous[i].potential_list = NULL;
-			}
+	neighborhood* nh = calloc(1, sizeof(neighborhood));
+	CHECK_MALLOC(nh);
+	nh->nPoints = nPoints;
+	neighbours_init(&nh->list, nPoints);
+	neighbours_init(&nh->potential_list, nPoints);
+	neighbours_init(&nh->half_list, nPoints);
+	neighbours_init(&nh->pair_list, nPoints);
+	neighbours_init(&nh->pair_buffer, nPoints);
+	return nh;
+}
+
+double* neighborhood_sums_reserve(neighborhood* nh, size_t nSums) {
+	if (nSums > nh->sumCapacity) {
+		nh->sums = realloc(nh->sums, nSums * sizeof(double));
+		CHECK_MALLOC(nh->sums);
+		nh->sumCapacity = nSums;
+	}
+	return nh->sums;
+}
+
+// function to empty the neighborhoods before filling them again
+// nh : neighborhoods of the previous iteration
+// iterations : used in the verlet algorithm to keep the same potential_list when this should not be updated
+void neighborhood_reset(neighborhood* nh, int iterations)
+{
+	nh->list_pairs.size = 0;
+	if (!iterations) {
+		nh->potential_pairs.size = 0;
+		nh->is_compact = 0;
 	}
-	return previous;
 }
 
-// function to properly delete the array of neighborhood nh, of size n
 void neighborhood_delete(neighborhood* nh) {
 	if (nh) {
-		for (int i = 0; i < NPTS; i++) {
-			neighbours_delete(nh[i].list);
-			neighbours_delete(nh[i].potential_list);
+		neighbours_delete(&nh->list);
+		neighbours_delete(&nh->potential_list);
+		pairs_delete(&nh->list_pairs);
+		pairs_delete(&nh->potential_pairs);
+		for (int t = 0; t < nh->nThreads; t++) {
+			pairs_delete(&nh->thread_list_pairs[t]);
+			pairs_delete(&nh->thread_potential_pairs[t]);
 		}
+		free(nh->thread_list_pairs);
+		free(nh->thread_potential_pairs);
+		compact_neighbours_delete(&nh->compact_potential);
+		neighbours_delete(&nh->half_list);
+		neighbours_delete(&nh->pair_list);
+		neighbours_delete(&nh->pair_buffer);
+		pairs_delete(&nh->added_pairs);
+		pairs_delete(&nh->removed_pairs);
+		free(nh->sums);
+		free(nh->threadCounts);
 		free(nh);
 	}
 }
 
-// function to create a node
-// c : arrays of the cells of the simulation
-// i : c[i] is the cell where the node should be included
-// index : index of the particle to be added in the cell c[i]
-struct node* node_new(cell* c, int i, int index)
-{
-	node* new = malloc(sizeof(node));
-	CHECK_MALLOC(new);
-	new->index = index;
-	new->next = c[i].ResidentList;
-	c[i].ResidentList = new;
-	c[i].nResident++;
-	return new;
+// function to make sure the grid can contain its nParticles particles and nActive cells
+void cell_grid_reserve(cell_grid* grid, int nActive) {
+	if (nActive + 1 > grid->nCells) {
+		int nCells = grid->nCells ? grid->nCells : 1024;
+		while (nCells < nActive + 1)
+			nCells *= 2;
+		grid->cellStart = realloc(grid->cellStart, (nCells + 1) * sizeof(int));
+		CHECK_MALLOC(grid->cellStart);
+		grid->nCells = nCells;
+	}
+	if (grid->nParticles > grid->nPoints) {
+		grid->nPoints = particle_capacity(grid->nPoints, grid->nParticles);
+		grid->cellParticles = realloc(grid->cellParticles, grid->nPoints * sizeof(int));
+		CHECK_MALLOC(grid->cellParticles);
+		grid->cellNumber = realloc(grid->cellNumber, grid->nPoints * sizeof(int));
+		CHECK_MALLOC(grid->cellNumber);
+		free(grid->previousParticles);
+		free(grid->cellKeys);
+		grid->previousParticles = NULL;
+		grid->cellKeys = NULL;
+		grid->nOrdered = 0;
+	}
+	if (grid->is_sorted && !grid->previousParticles) {
+		grid->previousParticles = malloc(grid->nPoints * sizeof(int));
+		CHECK_MALLOC(grid->previousParticles);
+		grid->cellKeys = malloc(grid->nPoints * sizeof(GLfloat));
+		CHECK_MALLOC(grid->cellKeys);
+		grid->nOrdered = 0;
+	}
+}
+
+// function that returns the number of threads used to fill the grid, 1 when there are too few particles to share them
+int cell_grid_threads(cell_grid* grid) {
+	return grid->nThreads > 1 && grid->nParticles >= PARALLEL_SORT_MIN ? grid->nThreads : 1;
 }
 
-// function to properly delete the node n given as argument
-void node_delete(node* n) {
-	if (n) {
-		neighbours* temp = n->next;
-		free(n);
-		node_delete(temp);
+// same as cell_grid_sort, with the particles shared between nThreads threads in contiguous blocks
+// each thread counts the particles of its block in each cell, the cells are shared in blocks to compute their start with an exclusive scan
+// of these counts, which also gives the position of the first particle of each thread in each cell, then each thread moves its particles:
+// the particles of a cell are thus in the same order as with the serial sort, whatever the number of threads
+// order : order in which the particles are taken, NULL for the order of their indices
+void cell_grid_sort_parallel(cell_grid* grid, int nThreads, const int* order) {
+	int nActive = grid->nActive;
+	int* cellStart = grid->cellStart;
+	int* cellNumber = grid->cellNumber;
+	int* cellParticles = grid->cellParticles;
+	// the counters of the threads are followed by the partial sums of the scan
+	size_t nCounts = (size_t)nThreads * nActive + nThreads + 1;
+	if (nCounts > grid->countCapacity) {
+		grid->threadCounts = realloc(grid->threadCounts, nCounts * sizeof(int));
+		CHECK_MALLOC(grid->threadCounts);
+		grid->countCapacity = nCounts;
 	}
+	int* blockSums = &grid->threadCounts[(size_t)nThreads * nActive];
+	int nTeam = 1;
+#pragma omp parallel num_threads(nThreads)
+	{
+		int t = 0;
+#ifdef _OPENMP
+		t = omp_get_thread_num();
+#pragma omp single
+		nTeam = omp_get_num_threads();
+#endif
+		int* counts = &grid->threadCounts[(size_t)t * nActive];
+		int begin = (int)((long long)grid->nParticles * t / nTeam);
+		int end = (int)((long long)grid->nParticles * (t + 1) / nTeam);
+		int cellBegin = (int)((long long)nActive * t / nTeam);
+		int cellEnd = (int)((long long)nActive * (t + 1) / nTeam);
+		memset(counts, 0, nActive * sizeof(int));
+		for (int k = begin; k < end; k++) {
+			int i = order ? order[k] : k;
+			if (cellNumber[i] >= 0)
+				counts[cellNumber[i]]++;
+		}
+#pragma omp barrier
+		int sum = 0;
+		for (int c = cellBegin; c < cellEnd; c++)
+			for (int u = 0; u < nTeam; u++)
+				sum += grid->threadCounts[(size_t)u * nActive + c];
+		blockSums[t + 1] = sum;
+#pragma omp barrier
+#pragma omp single
+		{
+			blockSums[0] = 0;
+			for (int u = 0; u < nTeam; u++)
+				blockSums[u + 1] += blockSums[u];
+		}
+		int position = blockSums[t];
+		for (int c = cellBegin; c < cellEnd; c++) {
+			cellStart[c] = position;
+			for (int u = 0; u < nTeam; u++) {
+				int* count = &grid->threadCounts[(size_t)u * nActive + c];
+				int particles = *count;
+				*count = position;
+				position += particles;
+			}
+		}
+#pragma omp barrier
+		for (int k = begin; k < end; k++) {
+			int i = order ? order[k] : k;
+			if (cellNumber[i] >= 0)
+				cellParticles[counts[cellNumber[i]]++] = i;
+		}
+	}
+	cellStart[nActive] = blockSums[nTeam];
 }
 
-// function to create an array of cells of size n
-cell* cell_new(GLsizei n)
-{
-	cell* c = calloc(n, sizeof(cell));
-	CHECK_MALLOC(c);
-	for (int i = 0; i < n; i++) {
-		c[i].nResident = 0;
-		c[i].ResidentList = NULL;
+// function to sort the particles by cell with a counting sort, once the cell of each particle is known
+// the particles whose cell is -1 are left out of the grid
+// the particles of a cell are in the order of their indices, or in their order of the previous sort for the sorted grid, see cell_grid_sort_cells
+void cell_grid_sort(cell_grid* grid) {
+	const int* order = NULL;
+	if (grid->is_sorted && grid->nOrdered == grid->nParticles) {
+		int* previous = grid->cellParticles;
+		grid->cellParticles = grid->previousParticles;
+		grid->previousParticles = previous;
+		order = previous;
+	}
+	int nThreads = cell_grid_threads(grid);
+	if (nThreads > 1) {
+		cell_grid_sort_parallel(grid, nThreads, order);
+		return;
+	}
+	int nActive = grid->nActive;
+	int* cellStart = grid->cellStart;
+	memset(cellStart, 0, (nActive + 1) * sizeof(int));
+	for (int i = 0; i < grid->nParticles; i++)
+		if (grid->cellNumber[i] >= 0)
+			cellStart[grid->cellNumber[i] + 1]++;
+	for (int c = 0; c < nActive; c++)
+		cellStart[c + 1] += cellStart[c];
+	// cellStart[c] is used as the cursor of the cell c, so that it ends up at the start of the cell c+1
+	for (int k = 0; k < grid->nParticles; k++) {
+		int i = order ? order[k] : k;
+		if (grid->cellNumber[i] >= 0)
+			grid->cellParticles[cellStart[grid->cellNumber[i]]++] = i;
+	}
+	for (int c = nActive; c > 0; c--)
+		cellStart[c] = cellStart[c - 1];
+	cellStart[0] = 0;
+}
+
+// function that returns the key of the particle at position used to sort the particles of a cell: its first coordinate,
+// brought back inside the domain along a periodic axis of the square grid by as many periods as its cell in cell_grid_locate
+float cell_grid_key(cell_grid* grid, GLfloat* position, int half_length) {
+	if (grid->is_hashed || !grid->periodic[0])
+		return position[0];
+	int size = grid->size;
+	int x = (int)floor((position[0] + half_length) * (size / (2.0 * half_length)));
+	int periods = x >= 0 ? x / size : -((size - 1 - x) / size);
+	return (float)(position[0] - 2.0 * half_length * periods);
+}
+
+// function that sorts the particles of each cell by key, once they are sorted by cell, and fills cellKeys
+// the particles of a cell keep their order of the previous sort, so that they are nearly sorted since they hardly move between two searches:
+// an insertion sort is then enough, while a shell sort is used when they are in the order of their indices
+void cell_grid_sort_cells(cell_grid* grid, GLfloat(* data)[DATA_COLUMNS], int half_length) {
+	static const int gaps[] = { 701, 301, 132, 57, 23, 10, 4, 1 };
+	int nGaps = sizeof(gaps) / sizeof(gaps[0]);
+	int first_gap = grid->nOrdered == grid->nParticles ? nGaps - 1 : 0;
+	int* cellStart = grid->cellStart;
+	int* cellParticles = grid->cellParticles;
+	GLfloat* keys = grid->cellKeys;
+#pragma omp parallel num_threads(cell_grid_threads(grid))
+	{
+#pragma omp for schedule(static)
+		for (int b = 0; b < cellStart[grid->nActive]; b++)
+			keys[b] = cell_grid_key(grid, data[cellParticles[b]], half_length);
+#pragma omp for schedule(dynamic, 256)
+		for (int c = 0; c < grid->nActive; c++) {
+			int begin = cellStart[c];
+			int end = cellStart[c + 1];
+			for (int g = first_gap; g < nGaps; g++) {
+				int gap = gaps[g];
+				for (int k = begin + gap; k < end; k++) {
+					GLfloat key = keys[k];
+					int particle = cellParticles[k];
+					int l = k;
+					for (; l - gap >= begin && keys[l - gap] > key; l -= gap) {
+						keys[l] = keys[l - gap];
+						cellParticles[l] = cellParticles[l - gap];
+					}
+					keys[l] = key;
+					cellParticles[l] = particle;
+				}
+			}
+		}
+	}
+	grid->nOrdered = cellStart[grid->nActive];
+}
+
+// function that narrows the range [*begin, *end) of the particles of the cell checking to the ones whose key is within radius of key,
+// the key of a particle of the cell this_cell; the particles of checking must be sorted by key, see cell_grid_sort_cells
+// when the stencil of this_cell wraps around the periodic x axis to reach checking, key is moved to its image next to checking
+// period : length of the domain along x, 0 if it is not periodic
+void cell_grid_prune(cell_grid* grid, int this_cell, int checking, float key, float radius, float period, int* begin, int* end) {
+	if (grid->is_wrapped && period > 0.0f) {
+		int difference = checking % grid->stride - this_cell % grid->stride;
+		if (difference > grid->subdivision)
+			key += period;
+		else if (difference < -grid->subdivision)
+			key -= period;
+	}
+	GLfloat* keys = grid->cellKeys;
+	int low = *begin;
+	int high = *end;
+	while (low < high) {
+		int middle = low + (high - low) / 2;
+		if (keys[middle] < key - radius)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+	*begin = low;
+	high = *end;
+	while (low < high) {
+		int middle = low + (high - low) / 2;
+		if (keys[middle] <= key + radius)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+	*end = low;
+}
+
+// function to make sure cellCoords and cellNeighbours can contain nCells cells, with the nStencil neighbours of the current subdivision
+void cell_grid_reserve_neighbours(cell_grid* grid, int nCells) {
+	if (nCells <= grid->occupiedCapacity)
+		return;
+	int capacity = grid->occupiedCapacity ? grid->occupiedCapacity : 1024;
+	while (capacity < nCells)
+		capacity *= 2;
+	grid->cellCoords = realloc(grid->cellCoords, capacity * sizeof(grid->cellCoords[0]));
+	CHECK_MALLOC(grid->cellCoords);
+	grid->cellNeighbours = realloc(grid->cellNeighbours, (size_t)grid->nStencil * capacity * sizeof(int));
+	CHECK_MALLOC(grid->cellNeighbours);
+	grid->occupiedCapacity = capacity;
+}
+
+// function to set the number of cells per search radius of the grid, and so the size of its stencil
+// the neighbours of the cells are then stored with another number of cells, so that cellNeighbours is reallocated by the next reservation
+void cell_grid_subdivide(cell_grid* grid, int subdivision) {
+	subdivision = subdivision < 1 ? 1 : (subdivision > MAX_SUBDIVISION ? MAX_SUBDIVISION : subdivision);
+	if (subdivision == grid->subdivision && grid->nStencil)
+		return;
+	grid->subdivision = subdivision;
+	grid->nStencil = 1;
+	for (int d = 0; d < DIMENSION; d++)
+		grid->nStencil *= 2 * subdivision + 1;
+	grid->occupiedCapacity = 0;
+	grid->is_wrapped = 0;
+}
+
+// function that fills offset with the position of the cell s of the stencil of grid relative to the center cell, in number of cells along each axis
+// the digits of s in base 2*subdivision+1 give the offset, from -subdivision to subdivision along each axis, x being the fastest one
+void cell_grid_stencil_offset(cell_grid* grid, int s, int offset[DIMENSION]) {
+	int base = 2 * grid->subdivision + 1;
+	for (int d = 0; d < DIMENSION; d++, s /= base)
+		offset[d] = s % base - grid->subdivision;
+}
+
+// function to fill cellNeighbours with the neighbours of every cell of the square grid, the stencil wrapping around the periodic axes
+// the ghost cells are kept along the other axes; a neighbour found twice is replaced by the ghost cell 0, which is always empty,
+// so that the pairs of particles are not checked twice when the grid has less than 3 cells along a periodic axis
+void cell_grid_wrap(cell_grid* grid) {
+	int size = grid->size;
+	int stride = grid->stride;
+	int subdivision = grid->subdivision;
+	int nStencil = grid->nStencil;
+	cell_grid_reserve_neighbours(grid, grid->nActive);
+	for (int c = 0; c < grid->nActive; c++) {
+		int cell[DIMENSION];
+		int is_ghost = 0;
+		for (int d = 0, rest = c; d < DIMENSION; d++, rest /= stride) {
+			cell[d] = rest % stride - subdivision;
+			is_ghost |= cell[d] < 0 || cell[d] >= size;
+		}
+		// the ghost cells are empty, so that their neighbours are never read
+		if (is_ghost)
+			continue;
+		int* neighbours = &grid->cellNeighbours[(size_t)nStencil * c];
+		for (int s = 0; s < nStencil; s++) {
+			int offset[DIMENSION];
+			cell_grid_stencil_offset(grid, s, offset);
+			int number = 0;
+			for (int d = DIMENSION - 1; d >= 0; d--) {
+				int x = cell[d] + offset[d];
+				if (grid->periodic[d])
+					x = ((x % size) + size) % size;
+				number = number * stride + x + subdivision;
+			}
+			for (int t = 0; t < s && number; t++)
+				if (neighbours[t] == number)
+					number = 0;
+			if (s != nStencil / 2 && number == c)
+				number = 0;
+			neighbours[s] = number;
+		}
+	}
+}
+
+// function to set the size of the square grid, whose arrays are only reallocated when they are too small
+// the grid is surrounded by a layer of empty ghost cells, so that the stencil of every cell can be used without checking the edges
+// along the periodic axes, the stencil wraps around the domain, see cell_grid_wrap
+// grid : cells to be resized
+// size : number of cells in a row, ghost cells excluded
+// subdivision : number of cells per search radius, which is also the number of layers of ghost cells
+// periodic : int used as a boolean for each axis to inform if the domain is periodic along this axis
+void cell_grid_resize(cell_grid* grid, int nPoints, int size, int subdivision, const int periodic[DIMENSION]) {
+	cell_grid_subdivide(grid, subdivision);
+	grid->nParticles = nPoints;
+	int stride = size + 2 * grid->subdivision;
+	int is_wrapped = 0;
+	int is_same_wrap = grid->is_wrapped && !grid->is_hashed && grid->size == size;
+	for (int d = 0; d < DIMENSION; d++) {
+		is_wrapped |= periodic[d];
+		is_same_wrap &= grid->periodic[d] == periodic[d];
+		grid->periodic[d] = periodic[d];
+	}
+	grid->is_hashed = 0;
+	grid->size = size;
+	grid->stride = stride;
+	grid->nActive = 1;
+	for (int d = 0; d < DIMENSION; d++)
+		grid->nActive *= stride;
+	cell_grid_reserve(grid, grid->nActive);
+	// the neighbours of the cells only change with the size of the grid
+	if (is_wrapped && !is_same_wrap)
+		cell_grid_wrap(grid);
+	grid->is_wrapped = is_wrapped;
+}
+
+// function that returns the number of the cell of the square grid containing position
+// along the periodic axes, the particles are put in the cell of their image inside the domain
+// half_length : half of the length of the side of the domain
+int cell_grid_locate(cell_grid* grid, GLfloat* position, int half_length) {
+	int size = grid->size;
+	double scale = size / (2.0 * half_length);
+	int cellNumber = 0;
+	for (int d = DIMENSION - 1; d >= 0; d--) {
+		int x;
+		if (grid->periodic[d]) {
+			x = (int)floor((position[d] + half_length) * scale) % size;
+			x = x < 0 ? x + size : x;
+		}
+		else {
+			// particles exactly on the boundary of the domain belong to the last cell
+			x = (int)((position[d] + half_length) * scale);
+			x = x < 0 ? 0 : (x >= size ? size - 1 : x);
+		}
+		cellNumber = cellNumber * grid->stride + x + grid->subdivision;
+	}
+	return cellNumber;
+}
+
+// function to sort the particles by cell with a counting sort, in a square grid of size cells per row
+// grid : cells to be filled
+// data : table that contains the informations of the particles of the simulation
+// size : number of cells in a row, ghost cells excluded
+// subdivision : number of cells per search radius
+// half_length : half of the length of the side of the domain
+// periodic : int used as a boolean for each axis to inform if the domain is periodic along this axis
+void cell_grid_fill(cell_grid* grid, GLfloat(* data)[DATA_COLUMNS], int nPoints, int size, int subdivision, int half_length, const int periodic[DIMENSION]) {
+	cell_grid_resize(grid, nPoints, size, subdivision, periodic);
+#pragma omp parallel for num_threads(cell_grid_threads(grid)) schedule(static)
+	for (int i = 0; i < nPoints; i++)
+		grid->cellNumber[i] = cell_grid_locate(grid, data[i], half_length);
+	cell_grid_sort(grid);
+	if (grid->is_sorted)
+		cell_grid_sort_cells(grid, data, half_length);
+}
+
+// function that returns the slot of the hash table where the cell of coordinates cell is stored, or the empty slot where it should be stored
+int cell_grid_hash_slot(cell_grid* grid, const int cell[DIMENSION]) {
+	unsigned long long key = ((unsigned long long)(unsigned int)cell[0] << 32) | (unsigned int)cell[1];
+#if DIMENSION == 3
+	key ^= (unsigned long long)(unsigned int)cell[2] * 0xC2B2AE3D27D4EB4FULL;
+#endif
+	unsigned int mask = grid->hashCapacity - 1;
+	unsigned int slot = (unsigned int)((key * 0x9E3779B97F4A7C15ULL) >> 32) & mask;
+	while (grid->hashCells[slot] != -1) {
+		int* coords = grid->cellCoords[grid->hashCells[slot]];
+		int is_equal = 1;
+		for (int d = 0; d < DIMENSION; d++)
+			is_equal &= coords[d] == cell[d];
+		if (is_equal)
+			break;
+		slot = (slot + 1) & mask;
 	}
+	return slot;
+}
+
+// function to empty the hash table, after making sure it has at least hashCapacity slots
+void cell_grid_hash_clear(cell_grid* grid, int hashCapacity) {
+	if (hashCapacity > grid->hashCapacity) {
+		grid->hashCells = realloc(grid->hashCells, hashCapacity * sizeof(int));
+		CHECK_MALLOC(grid->hashCells);
+		grid->hashCapacity = hashCapacity;
+	}
+	memset(grid->hashCells, -1, grid->hashCapacity * sizeof(int));
+}
+
+// function that returns the number of the occupied cell of coordinates cell, which is added to the hash table if it is not found
+int cell_grid_hash_insert(cell_grid* grid, const int cell[DIMENSION]) {
+	int slot = cell_grid_hash_slot(grid, cell);
+	if (grid->hashCells[slot] != -1)
+		return grid->hashCells[slot];
+	if (2 * (grid->nOccupied + 1) > grid->hashCapacity) {
+		// the hash table is kept at most half full, so that the probing sequences stay short
+		cell_grid_hash_clear(grid, 2 * grid->hashCapacity);
+		for (int c = 0; c < grid->nOccupied; c++)
+			grid->hashCells[cell_grid_hash_slot(grid, grid->cellCoords[c])] = c;
+		slot = cell_grid_hash_slot(grid, cell);
+	}
+	cell_grid_reserve_neighbours(grid, grid->nOccupied + 1);
+	int c = grid->nOccupied++;
+	memcpy(grid->cellCoords[c], cell, sizeof(grid->cellCoords[0]));
+	grid->hashCells[slot] = c;
 	return c;
 }
 
-// function to properly delete the array of cells c of size n given as arguments
-void cell_delete(cell* c, GLsizei n) {
-	if (c) {
-		for (int i = 0; i < n; i++)
-			node_delete(c[i].ResidentList);
-		free(c);
+// function to sort the particles by cell with a counting sort, only the occupied cells being stored; the particles can be anywhere
+// the memory used by the grid only depends on the number of particles and of occupied cells, not on the size of the domain
+// grid : cells to be filled
+// data : table that contains the informations of the particles of the simulation
+// width : length of the side of the cells
+// subdivision : number of cells per search radius
+void cell_grid_fill_hashed(cell_grid* grid, GLfloat(* data)[DATA_COLUMNS], int nPoints, double width, int subdivision) {
+	cell_grid_subdivide(grid, subdivision);
+	grid->nParticles = nPoints;
+	grid->is_hashed = 1;
+	grid->is_wrapped = 0;
+	grid->width = width;
+	// the hash table starts as large as needed by the previous iteration, since the number of occupied cells changes slowly
+	int hashCapacity = 1024;
+	while (hashCapacity < 2 * grid->nOccupied)
+		hashCapacity *= 2;
+	cell_grid_hash_clear(grid, hashCapacity);
+	grid->nOccupied = 0;
+	cell_grid_reserve(grid, 0);
+	for (int i = 0; i < nPoints; i++) {
+		int cell[DIMENSION];
+		for (int d = 0; d < DIMENSION; d++)
+			cell[d] = (int)floor(data[i][d] / width);
+		grid->cellNumber[i] = cell_grid_hash_insert(grid, cell);
+	}
+	int nOccupied = grid->nOccupied;
+	int nStencil = grid->nStencil;
+	for (int c = 0; c < nOccupied; c++) {
+		int* neighbours = &grid->cellNeighbours[(size_t)nStencil * c];
+		for (int s = 0; s < nStencil; s++) {
+			int cell[DIMENSION];
+			cell_grid_stencil_offset(grid, s, cell);
+			for (int d = 0; d < DIMENSION; d++)
+				cell[d] += grid->cellCoords[c][d];
+			int slot = cell_grid_hash_slot(grid, cell);
+			neighbours[s] = grid->hashCells[slot] == -1 ? nOccupied : grid->hashCells[slot];
+		}
+	}
+	// the cell nOccupied stays empty
+	grid->nActive = nOccupied + 1;
+	cell_grid_reserve(grid, grid->nActive);
+	cell_grid_sort(grid);
+	if (grid->is_sorted)
+		cell_grid_sort_cells(grid, data, 0);
+}
+
+// function to fill the grid again with the current positions, with the same cells as the last time it was filled
+void cell_grid_refill(cell_grid* grid, GLfloat(* data)[DATA_COLUMNS], int nPoints, int half_length) {
+	if (grid->is_hashed)
+		cell_grid_fill_hashed(grid, data, nPoints, grid->width, grid->subdivision);
+	else
+		cell_grid_fill(grid, data, nPoints, grid->size, grid->subdivision, half_length, grid->periodic);
+}
+
+// function that returns 1 when the cell s of the stencil of grid is entirely farther than the search radius from the center cell
+// the gap between the cells is the offset minus one cell along each axis, and the search radius is subdivision cells wide
+int cell_grid_is_corner(cell_grid* grid, int s) {
+	int offset[DIMENSION];
+	cell_grid_stencil_offset(grid, s, offset);
+	int gap = 0;
+	for (int d = 0; d < DIMENSION; d++) {
+		int cells = abs(offset[d]) - 1;
+		gap += cells > 0 ? cells * cells : 0;
+	}
+	return gap > grid->subdivision * grid->subdivision;
+}
+
+// function that fills stencil with the offsets of the cells to be checked by the particles of a cell, and returns their number
+// the full stencil contains the nStencil cells around the cell, 9 in 2D and 27 in 3D with one cell per search radius; the half stencil
+// only contains the cell itself first and the cells after it, 5 in 2D and 14 in 3D, so that each pair of neighbouring cells is checked once
+// with skip_corners, the cells entirely farther than the search radius are left out of both stencils
+// with the hash table or the wrapped grid, the stencil contains the positions in cellNeighbours instead of offsets, see CELL_NEIGHBOUR
+// grid : cells of the simulation
+// stencil : array of at least nStencil cells, MAX_STENCIL_SIZE being always enough
+// use_half_stencil : int used as a boolean to choose the half stencil
+int cell_grid_stencil(cell_grid* grid, int* stencil, int use_half_stencil) {
+	int nStencil = 0;
+	if (grid->is_hashed || grid->is_wrapped) {
+		for (int k = use_half_stencil ? grid->nStencil / 2 : 0; k < grid->nStencil; k++)
+			if (!grid->skip_corners || !cell_grid_is_corner(grid, k))
+				stencil[nStencil++] = k;
+		return nStencil;
+	}
+	if (use_half_stencil)
+		stencil[nStencil++] = 0;
+	for (int s = 0; s < grid->nStencil; s++) {
+		int cell[DIMENSION];
+		cell_grid_stencil_offset(grid, s, cell);
+		int offset = 0;
+		for (int d = 0, factor = 1; d < DIMENSION; d++, factor *= grid->stride)
+			offset += cell[d] * factor;
+		if ((!use_half_stencil || offset > 0) && (!grid->skip_corners || !cell_grid_is_corner(grid, s)))
+			stencil[nStencil++] = offset;
+	}
+	return nStencil;
+}
+
+// number of the cell of the stencil s of the cell c
+#define CELL_NEIGHBOUR(grid, c, stencil, s) ((grid)->is_hashed || (grid)->is_wrapped ? (grid)->cellNeighbours[(size_t)(grid)->nStencil * (c) + (stencil)[s]] : (c) + (stencil)[s])
+
+// function to properly free the arrays of the grid
+void cell_grid_delete(cell_grid* grid) {
+	free(grid->cellStart);
+	free(grid->cellParticles);
+	free(grid->cellNumber);
+	free(grid->cellCoords);
+	free(grid->cellNeighbours);
+	free(grid->hashCells);
+	free(grid->cellPositions);
+	free(grid->threadCounts);
+	free(grid->previousParticles);
+	free(grid->cellKeys);
+}
+
+// function that copies the coordinates of the particles into cellPositions, in the order of cellParticles, once the grid is filled
+void cell_grid_gather(cell_grid* grid, GLfloat(* data)[DATA_COLUMNS]) {
+	int nSorted = grid->cellStart[grid->nActive];
+	if (nSorted + SIMD_PADDING > grid->positionStride) {
+		grid->positionStride = grid->nPoints + SIMD_PADDING;
+		free(grid->cellPositions);
+		grid->cellPositions = calloc((size_t)DIMENSION * grid->positionStride, sizeof(GLfloat));
+		CHECK_MALLOC(grid->cellPositions);
+	}
+#pragma omp parallel for num_threads(cell_grid_threads(grid)) schedule(static)
+	for (int b = 0; b < nSorted; b++)
+		for (int d = 0; d < DIMENSION; d++)
+			grid->cellPositions[d * grid->positionStride + b] = data[grid->cellParticles[b]][d];
+}
+
+// function that writes in hits the positions b, from begin to end-1 in cellParticles, of the particles closer than sqrt(squared_radius)
+// to position, and returns their number; positions are the cellPositions of the grid, whose axes are stride floats apart
+// period : length of the domain along each axis, 0 if it is not periodic
+// the distances are computed in single precision, so that squared_radius must be a bit larger than the one of the exact test done on the hits
+int cell_filter_scalar(const GLfloat* positions, int stride, const float position[DIMENSION], int begin, int end, float squared_radius, const float period[DIMENSION], int* hits) {
+	int nHits = 0;
+	for (int b = begin; b < end; b++) {
+		float squared = 0.0f;
+		for (int d = 0; d < DIMENSION; d++) {
+			float dx = positions[d * stride + b] - position[d];
+			if (period[d] > 0.0f)
+				dx -= period[d] * rintf(dx / period[d]);
+			squared += dx * dx;
+		}
+		if (squared <= squared_radius)
+			hits[nHits++] = b;
+	}
+	return nHits;
+}
+
+#ifdef USE_X86_SIMD
+// same as cell_filter_scalar, 8 particles at a time; the hits are extracted from the mask of the comparison
+// along an axis that is not periodic, the inverse of the period is 0, so that the closest image is the particle itself
+__attribute__((target("avx2")))
+int cell_filter_avx2(const GLfloat* positions, int stride, const float position[DIMENSION], int begin, int end, float squared_radius, const float period[DIMENSION], int* hits) {
+	__m256 center[DIMENSION];
+	__m256 length[DIMENSION];
+	__m256 inverse[DIMENSION];
+	for (int d = 0; d < DIMENSION; d++) {
+		center[d] = _mm256_set1_ps(position[d]);
+		length[d] = _mm256_set1_ps(period[d]);
+		inverse[d] = _mm256_set1_ps(period[d] > 0.0f ? 1.0f / period[d] : 0.0f);
+	}
+	__m256 radius = _mm256_set1_ps(squared_radius);
+	int nHits = 0;
+	for (int b = begin; b < end; b += 8) {
+		__m256 squared = _mm256_setzero_ps();
+		for (int d = 0; d < DIMENSION; d++) {
+			__m256 dx = _mm256_sub_ps(_mm256_loadu_ps(&positions[d * stride + b]), center[d]);
+			__m256 images = _mm256_round_ps(_mm256_mul_ps(dx, inverse[d]), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+			dx = _mm256_sub_ps(dx, _mm256_mul_ps(images, length[d]));
+			squared = _mm256_add_ps(squared, _mm256_mul_ps(dx, dx));
+		}
+		unsigned int mask = _mm256_movemask_ps(_mm256_cmp_ps(squared, radius, _CMP_LE_OQ));
+		// the lanes after end read the next cell or the padding
+		if (end - b < 8)
+			mask &= (1u << (end - b)) - 1;
+		while (mask) {
+			hits[nHits++] = b + __builtin_ctz(mask);
+			mask &= mask - 1;
+		}
+	}
+	return nHits;
+}
+
+// same as cell_filter_avx2, 16 particles at a time; the hits are written with a compress-store of the positions of the lanes
+__attribute__((target("avx512f")))
+int cell_filter_avx512(const GLfloat* positions, int stride, const float position[DIMENSION], int begin, int end, float squared_radius, const float period[DIMENSION], int* hits) {
+	__m512 center[DIMENSION];
+	__m512 length[DIMENSION];
+	__m512 inverse[DIMENSION];
+	for (int d = 0; d < DIMENSION; d++) {
+		center[d] = _mm512_set1_ps(position[d]);
+		length[d] = _mm512_set1_ps(period[d]);
+		inverse[d] = _mm512_set1_ps(period[d] > 0.0f ? 1.0f / period[d] : 0.0f);
+	}
+	__m512 radius = _mm512_set1_ps(squared_radius);
+	__m512i lanes = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+	int nHits = 0;
+	for (int b = begin; b < end; b += 16) {
+		__mmask16 valid = end - b < 16 ? (__mmask16)((1u << (end - b)) - 1) : (__mmask16)0xFFFF;
+		__m512 squared = _mm512_setzero_ps();
+		for (int d = 0; d < DIMENSION; d++) {
+			__m512 dx = _mm512_sub_ps(_mm512_maskz_loadu_ps(valid, &positions[d * stride + b]), center[d]);
+			__m512 images = _mm512_roundscale_ps(_mm512_mul_ps(dx, inverse[d]), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+			dx = _mm512_sub_ps(dx, _mm512_mul_ps(images, length[d]));
+			squared = _mm512_add_ps(squared, _mm512_mul_ps(dx, dx));
+		}
+		__mmask16 mask = _mm512_mask_cmp_ps_mask(valid, squared, radius, _CMP_LE_OQ);
+		_mm512_mask_compressstoreu_epi32(&hits[nHits], mask, _mm512_add_epi32(_mm512_set1_epi32(b), lanes));
+		nHits += __builtin_popcount(mask);
+	}
+	return nHits;
+}
+#endif
+
+// function that returns the best level of instructions of the distance filter supported by the processor
+// nothing is cached, so that the searches of several simulations running at the same time can call it
+simd_level neighborhood_simd_supported() {
+	simd_level level = SIMD_SCALAR;
+#ifdef USE_X86_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f"))
+		level = SIMD_AVX512;
+	else if (__builtin_cpu_supports("avx2"))
+		level = SIMD_AVX2;
+#endif
+	return level;
+}
+
+// function that returns the level of instructions asked by options, or the best supported one when the processor does not support it
+simd_level neighborhood_simd(neighborhood_options* options) {
+	simd_level supported = neighborhood_simd_supported();
+	if (options->simd == SIMD_OFF)
+		return SIMD_OFF;
+	return options->simd == SIMD_AUTO || options->simd > supported ? supported : options->simd;
+}
+
+// function that writes in hits the positions b, from begin to end-1 in cellParticles, of the particles of the grid that may be closer than
+// sqrt(squared_radius) to position, and returns their number; end-begin must not exceed FILTER_CHUNK
+// with SIMD_OFF, all the particles are hits, and the cellPositions of the grid are not needed
+int cell_grid_filter(cell_grid* grid, simd_level level, const float position[DIMENSION], int begin, int end, float squared_radius, const float period[DIMENSION], int* hits) {
+	const GLfloat* positions = grid->cellPositions;
+	int stride = grid->positionStride;
+	switch (level) {
+#ifdef USE_X86_SIMD
+	case SIMD_AVX512:
+		return cell_filter_avx512(positions, stride, position, begin, end, squared_radius, period, hits);
+	case SIMD_AVX2:
+		return cell_filter_avx2(positions, stride, position, begin, end, squared_radius, period, hits);
+#endif
+	case SIMD_OFF:
+		for (int b = begin; b < end; b++)
+			hits[b - begin] = b;
+		return end - begin;
+	default:
+		return cell_filter_scalar(positions, stride, position, begin, end, squared_radius, period, hits);
+	}
+}
+
+// function that prepares the filter of the cell searches: the coordinates are gathered in the grid when the filter is used,
+// and the squared radius of the filter is returned, a bit larger than radius so that the rounding errors of single precision do not lose any pair
+// period is converted to single precision in filter_period
+float cell_grid_filter_prepare(cell_grid* grid, simd_level level, GLfloat(* data)[DATA_COLUMNS], double radius, const double period[DIMENSION], float filter_period[DIMENSION]) {
+	double largest = radius;
+	for (int d = 0; d < DIMENSION; d++) {
+		filter_period[d] = (float)period[d];
+		largest = fmax(largest, period[d]);
+	}
+	if (level != SIMD_OFF)
+		cell_grid_gather(grid, data);
+	radius += 1e-5 * (radius + largest);
+	return (float)(radius * radius);
+}
+
+// function that spreads the bits of x so that DIMENSION-1 zeros are inserted between them
+// in 3D, only the 21 lowest bits of x are kept, so that the 3 interleaved coordinates fit in 64 bits
+unsigned long long morton_spread(unsigned int x) {
+	unsigned long long code = x;
+#if DIMENSION == 3
+	code &= 0x1FFFFFULL;
+	code = (code | (code << 32)) & 0x001F00000000FFFFULL;
+	code = (code | (code << 16)) & 0x001F0000FF0000FFULL;
+	code = (code | (code << 8)) & 0x100F00F00F00F00FULL;
+	code = (code | (code << 4)) & 0x10C30C30C30C30C3ULL;
+	code = (code | (code << 2)) & 0x1249249249249249ULL;
+#else
+	code = (code | (code << 16)) & 0x0000FFFF0000FFFFULL;
+	code = (code | (code << 8)) & 0x00FF00FF00FF00FFULL;
+	code = (code | (code << 4)) & 0x0F0F0F0F0F0F0F0FULL;
+	code = (code | (code << 2)) & 0x3333333333333333ULL;
+	code = (code | (code << 1)) & 0x5555555555555555ULL;
+#endif
+	return code;
+}
+
+// function that interleaves the bits of the coordinates of a cell to give its Morton code
+unsigned long long morton_code(const unsigned int cell[DIMENSION]) {
+	unsigned long long code = 0;
+	for (int d = 0; d < DIMENSION; d++)
+		code |= morton_spread(cell[d]) << d;
+	return code;
+}
+
+// function to renumber the rows and the neighbours of the table n after a reordering of the particles, or after some of them were added or removed
+// p : empty pairs used as a buffer
+// slot : the particle stored at the index i is now stored at the index slot[i], -1 if it was removed, in which case its pairs are dropped
+// nRows : number of rows of the renumbered table
+void neighbours_renumber(neighbours* n, neighbour_pairs* p, int* slot, int nRows) {
+	pairs_reserve(p, n->size);
+	for (int i = 0; i < n->nRows; i++) {
+		if (slot[i] < 0)
+			continue;
+		for (int k = n->start[i]; k < n->start[i + 1]; k++)
+			if (slot[n->index[k]] >= 0)
+				pairs_push(p, slot[i], slot[n->index[k]], n->distance[k], n->displacement[k]);
+	}
+	neighbours_resize(n, nRows);
+	neighbours_build(n, p);
+}
+
+// function used by qsort to sort the occupied cells by Morton code
+int morton_compare(const void* a, const void* b) {
+	unsigned long long code_a = ((const unsigned long long*)a)[0];
+	unsigned long long code_b = ((const unsigned long long*)b)[0];
+	return (code_a > code_b) - (code_a < code_b);
+}
+
+// function that fills codeStart and cellNumber so that the particles can be sorted by the rank of their cell along the Morton curve
+// only the occupied cells are ranked, sorted by code, so that codeStart never has more entries than particles whatever the size of the grid;
+// the coordinates of the cells of the hash table are taken from the smallest ones, and only their 21 lowest bits are used in 3D (32 in 2D)
+// returns the number of ranks
+int morton_rank(morton_order* reorder, cell_grid* grid) {
+	int nCells = grid->is_hashed ? grid->nOccupied : grid->nActive;
+	int nCodes = 0;
+	for (int c = 0; c < nCells; c++)
+		nCodes += grid->cellStart[c + 1] > grid->cellStart[c];
+	if (nCodes > reorder->nCellCodes) {
+		reorder->cellCodes = realloc(reorder->cellCodes, nCodes * sizeof(reorder->cellCodes[0]));
+		CHECK_MALLOC(reorder->cellCodes);
+		reorder->nCellCodes = nCodes;
+	}
+	int min[DIMENSION];
+	for (int d = 0; d < DIMENSION; d++) {
+		min[d] = grid->is_hashed && nCells ? grid->cellCoords[0][d] : grid->subdivision;
+		for (int c = 1; c < nCells && grid->is_hashed; c++)
+			if (grid->cellCoords[c][d] < min[d])
+				min[d] = grid->cellCoords[c][d];
+	}
+	int r = 0;
+	for (int c = 0; c < nCells; c++) {
+		if (grid->cellStart[c + 1] == grid->cellStart[c])
+			continue;
+		unsigned int cell[DIMENSION];
+		for (int d = 0, number = c; d < DIMENSION; d++) {
+			if (grid->is_hashed)
+				cell[d] = (unsigned int)(grid->cellCoords[c][d] - min[d]);
+			else {
+				cell[d] = (unsigned int)(number % grid->stride - min[d]);
+				number /= grid->stride;
+			}
+		}
+		reorder->cellCodes[r][0] = morton_code(cell);
+		reorder->cellCodes[r][1] = c;
+		r++;
 	}
+	qsort(reorder->cellCodes, nCodes, sizeof(reorder->cellCodes[0]), morton_compare);
+	for (r = 0; r < nCodes; r++) {
+		int c = (int)reorder->cellCodes[r][1];
+		for (int k = grid->cellStart[c]; k < grid->cellStart[c + 1]; k++)
+			grid->cellNumber[grid->cellParticles[k]] = r;
+	}
+	if (nCodes > reorder->nCodes) {
+		reorder->codeStart = realloc(reorder->codeStart, (nCodes + 1) * sizeof(int));
+		CHECK_MALLOC(reorder->codeStart);
+		reorder->nCodes = nCodes;
+	}
+	return nCodes;
 }
 
-void printNeighborhood(neighborhood* nh, GLfloat(* data)[8]) {
-	for (int i = 0; i < NPTS; i++) {
-		printf("Resident %i : coordinate: %f %f   number of neighbours %i\n", i + 1, data[i][0], data[i][1], nh[i].nNeighbours);
+void neighborhood_reorder(neighborhood_options* options, neighborhood* nh, GLfloat(* data)[DATA_COLUMNS]) {
+	morton_order* reorder = &options->reorder;
+	cell_grid* grid = &options->grid;
+	if (options->nPoints > reorder->nPoints) {
+		reorder->nPoints = particle_capacity(reorder->nPoints, options->nPoints);
+		reorder->order = realloc(reorder->order, reorder->nPoints * sizeof(int));
+		CHECK_MALLOC(reorder->order);
+		reorder->slot = realloc(reorder->slot, reorder->nPoints * sizeof(int));
+		CHECK_MALLOC(reorder->slot);
+		reorder->buffer = realloc(reorder->buffer, reorder->nPoints * sizeof(reorder->buffer[0]));
+		CHECK_MALLOC(reorder->buffer);
+	}
+
+	if (options->tree.is_active) {
+		// with the kd-tree, the particles are sorted in the order of its leaves, which keeps the particles close in space as close in memory
+		for (int k = 0; k < options->nPoints; k++) {
+			reorder->order[k] = options->tree.treeParticles[k];
+			reorder->slot[reorder->order[k]] = k;
+		}
+	}
+	else {
+		// the cells are computed with the current positions, since the particles may have moved since the last update of the grid
+		// with the levels of cells, all the particles are sorted along the Morton curve of the cells of the finest level
+		if (options->particle_kh)
+			cell_grid_fill(grid, data, options->nPoints, options->levels[0].size, 1, options->half_length, options->periodic);
+		else
+			cell_grid_refill(grid, data, options->nPoints, options->half_length);
+		int nCodes = morton_rank(reorder, grid);
+		int* codeStart = reorder->codeStart;
+		memset(codeStart, 0, (nCodes + 1) * sizeof(int));
+		for (int i = 0; i < options->nPoints; i++)
+			codeStart[grid->cellNumber[i] + 1]++;
+		for (int c = 0; c < nCodes; c++)
+			codeStart[c + 1] += codeStart[c];
+		for (int i = 0; i < options->nPoints; i++) {
+			int k = codeStart[grid->cellNumber[i]]++;
+			reorder->order[k] = i;
+			reorder->slot[i] = k;
+		}
+	}
+
+	memcpy(reorder->buffer, data, options->nPoints * sizeof(data[0]));
+	for (int k = 0; k < options->nPoints; k++)
+		memcpy(data[k], reorder->buffer[reorder->order[k]], sizeof(data[0]));
+	// the buffer is reused to permute the identifiers
+	int* previous_id = (int*)reorder->buffer;
+	memcpy(previous_id, reorder->particle_id, options->nPoints * sizeof(int));
+	for (int k = 0; k < options->nPoints; k++)
+		reorder->particle_id[k] = previous_id[reorder->order[k]];
+
+	// the buffer is reused again to permute the positions of the last update of the potential_list
+	GLfloat(*previous_positions)[DIMENSION] = (GLfloat(*)[DIMENSION])reorder->buffer;
+	memcpy(previous_positions, options->verlet_positions, options->nPoints * sizeof(options->verlet_positions[0]));
+	for (int k = 0; k < options->nPoints; k++)
+		memcpy(options->verlet_positions[k], previous_positions[reorder->order[k]], sizeof(options->verlet_positions[0]));
+
+	// and to permute the radii of the particles
+	if (options->particle_kh) {
+		double* previous_kh = (double*)reorder->buffer;
+		memcpy(previous_kh, options->particle_kh, options->nPoints * sizeof(double));
+		for (int k = 0; k < options->nPoints; k++)
+			options->particle_kh[k] = previous_kh[reorder->order[k]];
+	}
+
+	neighbours_renumber(&nh->list, &nh->list_pairs, reorder->slot, options->nPoints);
+	if (options->use_half_lists)
+		neighbours_renumber(&nh->half_list, &nh->list_pairs, reorder->slot, options->nPoints);
+	// the pairs of the previous iteration are given with the new indices, so that they can still be compared with the new ones
+	if (options->use_pair_changes) {
+		neighbours_renumber(&nh->pair_list, &nh->list_pairs, reorder->slot, options->nPoints);
+		neighbours_sort_pairs(&nh->pair_list, &nh->pair_list, 1, &nh->list_pairs);
+	}
+	// the compact potential_list is compacted again by neighborhood_update, with the small differences of index given by the new order
+	if (nh->is_compact)
+		neighborhood_expand(nh);
+	neighbours_renumber(&nh->potential_list, &nh->potential_pairs, reorder->slot, options->nPoints);
+	// the tree keeps the same nodes, so that it can still be refitted
+	if (options->tree.nNodes)
+		for (int k = 0; k < options->nPoints; k++)
+			options->tree.treeParticles[k] = reorder->slot[options->tree.treeParticles[k]];
+	// the levels of cells keep the same particles until the next search, so that neighborhood_probe can still use them
+	for (int m = 0; m < options->nLevels; m++)
+		for (int k = 0; k < options->levels[m].cellStart[options->levels[m].nActive]; k++)
+			options->levels[m].cellParticles[k] = reorder->slot[options->levels[m].cellParticles[k]];
+	// the order of the particles in the cells is kept for the next sort of the sorted grid
+	if (grid->nOrdered == options->nPoints)
+		for (int k = 0; k < options->nPoints; k++)
+			grid->cellParticles[k] = reorder->slot[grid->cellParticles[k]];
+	// the particles of each cell are now contiguous in the data table
+	if (!options->tree.is_active)
+		cell_grid_refill(grid, data, options->nPoints, options->half_length);
+}
+
+// function to properly free the arrays of the reordering
+void morton_order_delete(morton_order* reorder) {
+	free(reorder->particle_id);
+	free(reorder->order);
+	free(reorder->slot);
+	free(reorder->codeStart);
+	free(reorder->buffer);
+	free(reorder->cellCodes);
+}
+
+// function used to print the coordinates of a particle
+// position : row of the particle in the data table
+void printPosition(GLfloat* position) {
+	for (int d = 0; d < DIMENSION; d++)
+		printf(" %f", position[d]);
+}
+
+void printNeighborhood(neighborhood* nh, GLfloat(* data)[DATA_COLUMNS]) {
+	neighbours* list = &nh->list;
+	for (int i = 0; i < nh->nPoints; i++) {
+		printf("Resident %i : coordinate:", i + 1);
+		printPosition(data[i]);
+		printf("   number of neighbours %i\n", list->start[i + 1] - list->start[i]);
 		int j = 1;
-		for (neighbours* current = nh[i].list; current; current = current->next)
-			printf("   Neighbours %i : %f %f\n", j++, data[current->index][0], data[current->index][1]);
+		for (int k = list->start[i]; k < list->start[i + 1]; k++) {
+			printf("   Neighbours %i :", j++);
+			printPosition(data[list->index[k]]);
+			printf("\n");
+		}
 	}
 }
 
 
 // function used to print cells
 // data : table of the data's of the particles
-// c : array of cells to be printed
-// size : number of cells in the simulation
-void printCell(GLfloat(* data)[8], cell* c, int size) {
-	for (int i = 0; i < size; i++) {
-		printf("Cell %i : %i\n", i + 1, c[i].nResident);
+// grid : cells to be printed
+void printCell(GLfloat(* data)[DATA_COLUMNS], cell_grid* grid) {
+	int nCells = grid->is_hashed ? grid->nOccupied : (int)pow(grid->size, DIMENSION);
+	for (int c = 0; c < nCells; c++) {
+		int cellNumber = c;
+		if (!grid->is_hashed) {
+			// the ghost cells are skipped
+			cellNumber = 0;
+			for (int d = 0, rest = c, factor = 1; d < DIMENSION; d++, rest /= grid->size, factor *= grid->stride)
+				cellNumber += (rest % grid->size + grid->subdivision) * factor;
+		}
+		printf("Cell %i : %i\n", c + 1, grid->cellStart[cellNumber + 1] - grid->cellStart[cellNumber]);
 		int j = 1;
-		for (node* current = c[i].ResidentList; current; current = current->next)
-			printf("   Neighbours %i : %f %f\n", j++, data[current->index][0], data[current->index][1]);
+		for (int k = grid->cellStart[cellNumber]; k < grid->cellStart[cellNumber + 1]; k++) {
+			printf("   Neighbours %i :", j++);
+			printPosition(data[grid->cellParticles[k]]);
+			printf("\n");
+		}
 	}
 }
 
 
-// funtion to compute the radius kh of the circle of influence of a particle
+// funtion to compute the radius kh of the circle of influence of a particle, for particles uniformly distributed in a unit square
 // nPoints : number of particles in the simulation
+// target_neighbours : mean number of neighbours wanted for each particle
 // RA : int used as a boolean to choose over the algorithm of the radius choice; 
-//      0 means the dummy algorithm, 1 means the more sophisticated algorithm expalined at the seminar ( (intersection between areaGrid and 1/4 areaCircle)/areaGrid = 21/nPoints)
-double compute_kh(int RA) {
-	double target = 21.0 / NPTS;
-	if (NPTS < 21)
+//      0 means the dummy algorithm, 1 means the more sophisticated algorithm expalined at the seminar ( (intersection between areaGrid and 1/4 areaCircle)/areaGrid = target_neighbours/nPoints)
+//      in 3D, the volume of 1/8 of the sphere is used instead, which is assumed to stay inside the cube (kh <= 1)
+double compute_kh(int nPoints, double target_neighbours, int RA) {
+	double target = target_neighbours / nPoints;
+#if DIMENSION == 3
+	if (nPoints < target_neighbours)
+		return sqrt(3.0);
+	else if (!RA)
+		return sqrt(3.0) * target;
+	return fmin(cbrt(6 * target / M_PI), sqrt(3.0));
+#else
+	if (nPoints < target_neighbours)
 		return sqrt(2.0);
 	else if (!RA)
 		return sqrt(2.0) * target;
@@ -176,289 +1524,1183 @@ double compute_kh(int RA) {
 		kh_min = sqrt((target - sin(acos(1.0 / kh_min)) * kh_min) / ((M_PI / 4 - acos(1.0 / kh_min))));
 	}
 	return kh_min;
+#endif
 }
 
 
-void neighborhood_update(neighborhood_options* options, neighborhood* nh, GLfloat(* data)[8], int iterations) {
-	if (options->use_verlet)
-		iterations = iterations % options->optimal_verlet_steps;
-	else
-		iterations = 0;
+// function that fills period with the length of the domain along each periodic axis, and 0 along the other ones
+void neighborhood_period(neighborhood_options* options, double period[DIMENSION]) {
+	for (int d = 0; d < DIMENSION; d++)
+		period[d] = options->periodic[d] ? 2.0 * options->half_length : 0.0;
+}
 
-	if (options->use_verlet && iterations)
-		neighborhood_new(nh,1);
-	else
-		neighborhood_new(nh,0);
+// function that returns the difference of coordinates dx between the closest images of two particles along an axis of length period
+// period : 0 if the axis is not periodic, so that dx is returned as is
+double periodic_difference(double dx, double period) {
+	if (period > 0.0 && fabs(dx) > 0.5 * period)
+		dx -= period * floor(dx / period + 0.5);
+	return dx;
+}
 
-	double kh = options->kh;
-	int use_verlet = options->use_verlet;
-	double L = 0.0;
-	if (use_verlet) {
-		L = options->L;
+// function that returns the distance between the particles p and q, given by their rows in the data table
+// period : length of the domain along each axis, 0 if it is not periodic; the distance is then the one between the closest images of the particles
+double particle_distance(GLfloat* p, GLfloat* q, const double period[DIMENSION]) {
+	double squared = 0.0;
+	for (int d = 0; d < DIMENSION; d++) {
+		double dx = periodic_difference((double)q[d] - (double)p[d], period[d]);
+		squared += dx * dx;
 	}
-	int use_improved_method = options->use_improved_method;
-	int half_length = options->half_length;
-	int use_cells = options->use_cells && (kh + L) < half_length / 3.0;
-	int size = ceil(half_length / (kh + L));
-	cell* cellArray = NULL;
-	if (use_cells) {
-		cellArray = cell_new(ceil(size) * ceil(size));
-		for (int i = 0; i < NPTS; i++) {
-			int cellNumber = ((int)((data[i][1] + half_length) / (2 * half_length) * size) * ceil(size) + (int)((data[i][0] + half_length) / (2 * half_length) * size));
-			if (data[i][1] == half_length)
-				cellNumber -= size;
-			if (data[i][0] == half_length)
-				cellNumber -= 1;
-			node_new(cellArray, cellNumber, i);
-		}
-	}
-	int cellCounter = 0;
-	unsigned long frameCount = 0;
-	int i = 0;
-	int	j = 1;
-	int checking_cell_number = -1;
-	int this_cell_number = -1;
-	int checked_cells = 0;
-	cell checking_cell;
-	node checking_node;
-	neighbours checking_neighbours;
-	cell this_cell;
-	node this_node;
-	int i_check = i - 1;
-	int j_check = j - 1;
-	int are_still_neighbours = 1;
-	while ((((use_verlet && iterations && use_cells) || !use_cells) && i < NPTS) || (use_cells && this_cell_number < size * size)) {
-		if (i != i_check) {
-			int are_still_neighbours = 1;
-			if (use_verlet && iterations) {
-				if (nh[i].potential_list) {
-					checking_neighbours = nh[i].potential_list[0];
-				}
-				else {
-					are_still_neighbours = 0;
-				}
+	return sqrt(squared);
+}
+
+// function that returns the squared distance between the particles p and q, and fills offset with the position of q minus the position of p
+// period : length of the domain along each axis, 0 if it is not periodic; the offset is then taken between the closest images of the particles
+// the searches compare the squared distance with the squared radius, so that the square root is only taken for the pairs that are kept
+double particle_offset(GLfloat* p, GLfloat* q, const double period[DIMENSION], double offset[DIMENSION]) {
+	double squared = 0.0;
+	for (int d = 0; d < DIMENSION; d++) {
+		offset[d] = periodic_difference((double)q[d] - (double)p[d], period[d]);
+		squared += offset[d] * offset[d];
+	}
+	return squared;
+}
+
+// function that returns the radius within which the particles i and j are neighbours: kh, or the combination of their own radii
+// given by options->pair_criterion when every particle has its own radius
+double pair_kh(neighborhood_options* options, int i, int j) {
+	if (!options->particle_kh)
+		return options->kh;
+	double kh_i = options->particle_kh[i];
+	double kh_j = options->particle_kh[j];
+	return options->pair_criterion == KH_MEAN ? 0.5 * (kh_i + kh_j) : fmax(kh_i, kh_j);
+}
+
+// function that fills the actual neighbours of every particle by only checking its potential neighbours, used by the verlet algorithm between two updates of the potential_list
+// nh : neighborhoods whose potential_list is up to date; when nh->is_half is set, each pair is added to both particles
+// data : table that contains the informations of the particles of the simulation
+// the radius of each pair and the periodic axes are given by options
+void neighborhood_filter(neighborhood_options* options, neighborhood* nh, GLfloat(* data)[DATA_COLUMNS]) {
+	neighbours* potential = &nh->potential_list;
+	compact_neighbours* compact = &nh->compact_potential;
+	int is_compact = nh->is_compact;
+	double period[DIMENSION];
+	neighborhood_period(options, period);
+	for (int i = 0; i < options->nPoints; i++) {
+		int position = is_compact ? compact->wordStart[i] : 0;
+		int begin = is_compact ? compact->start[i] : potential->start[i];
+		int end = is_compact ? compact->start[i + 1] : potential->start[i + 1];
+		for (int k = begin; k < end; k++) {
+			int index_j = is_compact ? compact_neighbours_decode(compact->words, &position, i) : potential->index[k];
+			double offset[DIMENSION];
+			double squared = particle_offset(data[i], data[index_j], period, offset);
+			double kh = pair_kh(options, i, index_j);
+			if (squared <= kh * kh) {
+				if (nh->is_half)
+					pairs_push_both(&nh->list_pairs, i, index_j, sqrt(squared), offset);
+				else
+					pairs_push(&nh->list_pairs, i, index_j, sqrt(squared), offset);
 			}
-			else if (use_cells) {
-				if (i == 0) {
-					this_cell_number = cellCounter;
-					cellCounter++;
-					while (!cellArray[this_cell_number].nResident && this_cell_number < size * size) {
-						this_cell_number = cellCounter;
-						cellCounter++;
-					}
-					if (this_cell_number < size * size) {
-						this_cell = cellArray[this_cell_number];
-						this_node = this_cell.ResidentList[0];
+		}
+	}
+	neighbours_build(&nh->list, &nh->list_pairs);
+}
+
+// function that returns the number of threads to be used by the neighborhood search, always 1 without OpenMP
+int neighborhood_threads(neighborhood_options* options) {
+#ifdef _OPENMP
+	return options->nThreads > 1 ? options->nThreads : 1;
+#else
+	return 1;
+#endif
+}
+
+// same as neighborhood_filter, with the rows of the potential_list shared between nThreads threads
+// the potential_list must contain the pairs in both directions, so that each row is filled by a single thread,
+// unless the half lists are used: each pair of the potential_list then gives a single pair of the half_list
+void neighborhood_filter_parallel(neighborhood_options* options, neighborhood* nh, GLfloat(* data)[DATA_COLUMNS], int nThreads) {
+	neighbours* potential = &nh->potential_list;
+	compact_neighbours* compact = &nh->compact_potential;
+	int is_compact = nh->is_compact;
+	double period[DIMENSION];
+	neighborhood_period(options, period);
+	neighborhood_threads_reserve(nh, nThreads);
+#pragma omp parallel num_threads(nThreads)
+	{
+		int t = 0;
+#ifdef _OPENMP
+		t = omp_get_thread_num();
+#endif
+		neighbour_pairs* list_pairs = &nh->thread_list_pairs[t];
+#pragma omp for schedule(static)
+		for (int i = 0; i < options->nPoints; i++) {
+			int position = is_compact ? compact->wordStart[i] : 0;
+			int begin = is_compact ? compact->start[i] : potential->start[i];
+			int end = is_compact ? compact->start[i + 1] : potential->start[i + 1];
+			for (int k = begin; k < end; k++) {
+				int index_j = is_compact ? compact_neighbours_decode(compact->words, &position, i) : potential->index[k];
+				double offset[DIMENSION];
+				double squared = particle_offset(data[i], data[index_j], period, offset);
+				double kh = pair_kh(options, i, index_j);
+				if (squared <= kh * kh)
+					pairs_push(list_pairs, i, index_j, sqrt(squared), offset);
+			}
+		}
+	}
+	neighbours_merge(options->use_half_lists ? &nh->half_list : &nh->list, nh->thread_list_pairs, nThreads);
+}
+
+// function that fills the neighborhoods nh with the half stencil: each pair of particles is checked once and added to both of them
+// the potential_list only contains each pair once, in the row of the particle that found it
+void neighborhood_search_half(neighborhood_options* options, neighborhood* nh, GLfloat(* data)[DATA_COLUMNS], double L) {
+	double kh2 = options->kh * options->kh;
+	double potential2 = (options->kh + L) * (options->kh + L);
+	int use_verlet = options->use_verlet;
+	cell_grid* grid = &options->grid;
+	int* cellStart = grid->cellStart;
+	int* cellParticles = grid->cellParticles;
+	int stencil[MAX_STENCIL_SIZE];
+	int nStencil = cell_grid_stencil(grid, stencil, 1);
+	double period[DIMENSION];
+	neighborhood_period(options, period);
+	simd_level level = neighborhood_simd(options);
+	float filter_period[DIMENSION];
+	float filter_radius = cell_grid_filter_prepare(grid, level, data, options->kh + L, period, filter_period);
+	float prune_radius = sqrtf(filter_radius);
+	int hits[FILTER_CHUNK];
+	// the ghost cells are empty, so that they are skipped
+	for (int this_cell_number = 0; this_cell_number < grid->nActive; this_cell_number++) {
+		for (int a = cellStart[this_cell_number]; a < cellStart[this_cell_number + 1]; a++) {
+			int index_i = cellParticles[a];
+			for (int s = 0; s < nStencil; s++) {
+				int checking_cell_number = CELL_NEIGHBOUR(grid, this_cell_number, stencil, s);
+				// in its own cell, a particle only checks the particles after it
+				int begin = s == 0 ? a + 1 : cellStart[checking_cell_number];
+				int end = cellStart[checking_cell_number + 1];
+				if (grid->is_sorted)
+					cell_grid_prune(grid, this_cell_number, checking_cell_number, grid->cellKeys[a], prune_radius, filter_period[0], &begin, &end);
+				for (int chunk = begin; chunk < end; chunk += FILTER_CHUNK) {
+					int nHits = cell_grid_filter(grid, level, data[index_i], chunk, end - chunk > FILTER_CHUNK ? chunk + FILTER_CHUNK : end, filter_radius, filter_period, hits);
+					for (int h = 0; h < nHits; h++) {
+						int index_j = cellParticles[hits[h]];
+						double offset[DIMENSION];
+						double squared = particle_offset(data[index_i], data[index_j], period, offset);
+						if (squared <= kh2)
+							pairs_push_both(&nh->list_pairs, index_i, index_j, sqrt(squared), offset);
+						if (use_verlet && squared <= potential2)
+							pairs_push(&nh->potential_pairs, index_i, index_j, sqrt(squared), offset);
 					}
 				}
-				else {
-					if (this_node.next)
-						this_node = *this_node.next;
-					else {
-						this_cell_number = cellCounter;
-						cellCounter++;
-						while (this_cell_number < size * size && !cellArray[this_cell_number].nResident && !cellArray[this_cell_number].ResidentList) {
-							this_cell_number = cellCounter;
-							cellCounter++;
-						}
-						if (this_cell_number < size * size) {
-							this_cell = cellArray[this_cell_number];
-							this_node = this_cell.ResidentList[0];
-						}
+			}
+		}
+	}
+	neighbours_build(&nh->list, &nh->list_pairs);
+	if (use_verlet) {
+		neighbours_build(&nh->potential_list, &nh->potential_pairs);
+		nh->is_half = 1;
+	}
+}
+
+// function that fills the neighborhoods nh with the full stencil, the particles being shared between nThreads threads
+// every particle checks all the particles of the full stencil around its own cell, so that its row is filled by a single thread;
+// the pairs found by each thread are kept in its own pairs and merged into the tables without any lock
+// with the half lists, every particle only checks the cells of the half stencil instead, and only keeps the pairs in its own row in the half_list;
+// when the half stencil can not be used, because of a periodic axis of less than 2*subdivision+1 cells, each pair is kept by its particle of smaller index
+void neighborhood_search_full(neighborhood_options* options, neighborhood* nh, GLfloat(* data)[DATA_COLUMNS], double L, int nThreads) {
+	double kh2 = options->kh * options->kh;
+	double potential2 = (options->kh + L) * (options->kh + L);
+	int use_verlet = options->use_verlet;
+	cell_grid* grid = &options->grid;
+	int* cellStart = grid->cellStart;
+	int* cellParticles = grid->cellParticles;
+	int is_half = options->use_half_lists;
+	int is_small = 0;
+	for (int d = 0; d < DIMENSION; d++)
+		is_small |= options->periodic[d] && !grid->is_hashed && grid->size < 2 * grid->subdivision + 1;
+	int use_half_stencil = is_half && !is_small;
+	// a cell reached twice with different images of x can not be pruned with a single key
+	int use_prune = grid->is_sorted && !is_small;
+	int stencil[MAX_STENCIL_SIZE];
+	int nStencil = cell_grid_stencil(grid, stencil, use_half_stencil);
+	double period[DIMENSION];
+	neighborhood_period(options, period);
+	simd_level level = neighborhood_simd(options);
+	float filter_period[DIMENSION];
+	float filter_radius = cell_grid_filter_prepare(grid, level, data, options->kh + L, period, filter_period);
+	float prune_radius = sqrtf(filter_radius);
+	neighborhood_threads_reserve(nh, nThreads);
+#pragma omp parallel num_threads(nThreads)
+	{
+		int t = 0;
+#ifdef _OPENMP
+		t = omp_get_thread_num();
+#endif
+		neighbour_pairs* list_pairs = &nh->thread_list_pairs[t];
+		neighbour_pairs* potential_pairs = &nh->thread_potential_pairs[t];
+		int hits[FILTER_CHUNK];
+#pragma omp for schedule(dynamic, 64)
+		for (int a = 0; a < options->nPoints; a++) {
+			int index_i = cellParticles[a];
+			int this_cell_number = grid->cellNumber[index_i];
+			for (int s = 0; s < nStencil; s++) {
+				int checking_cell_number = CELL_NEIGHBOUR(grid, this_cell_number, stencil, s);
+				// in its own cell, a particle only checks the particles after it with the half stencil
+				int begin = use_half_stencil && s == 0 ? a + 1 : cellStart[checking_cell_number];
+				int end = cellStart[checking_cell_number + 1];
+				if (use_prune)
+					cell_grid_prune(grid, this_cell_number, checking_cell_number, grid->cellKeys[a], prune_radius, filter_period[0], &begin, &end);
+				for (int chunk = begin; chunk < end; chunk += FILTER_CHUNK) {
+					int nHits = cell_grid_filter(grid, level, data[index_i], chunk, end - chunk > FILTER_CHUNK ? chunk + FILTER_CHUNK : end, filter_radius, filter_period, hits);
+					for (int h = 0; h < nHits; h++) {
+						int index_j = cellParticles[hits[h]];
+						if (index_j == index_i || (is_half && is_small && index_j < index_i))
+							continue;
+						double offset[DIMENSION];
+						double squared = particle_offset(data[index_i], data[index_j], period, offset);
+						if (squared <= kh2)
+							pairs_push(list_pairs, index_i, index_j, sqrt(squared), offset);
+						if (use_verlet && squared <= potential2)
+							pairs_push(potential_pairs, index_i, index_j, sqrt(squared), offset);
 					}
 				}
-				checked_cells = 0;
-				if (use_improved_method && this_cell_number < size * size) {
-					if (this_node.next) {
-						checking_cell_number = this_cell_number;
-						checking_cell = cellArray[checking_cell_number];
-						checking_node = *this_node.next;
-					}
-					else {
-						checking_cell_number = find_next_cell(this_cell_number, ++checked_cells, size, use_improved_method);
-						while (checking_cell_number != -1 && !cellArray[checking_cell_number].nResident && !cellArray[checking_cell_number].ResidentList)
-							checking_cell_number = find_next_cell(this_cell_number, ++checked_cells, size, use_improved_method);
-						if (checking_cell_number != -1) {
-							checking_cell = cellArray[checking_cell_number];
-							checking_node = checking_cell.ResidentList[0];
-						}
+			}
+		}
+	}
+	neighbours_merge(is_half ? &nh->half_list : &nh->list, nh->thread_list_pairs, nThreads);
+	if (use_verlet) {
+		neighbours_merge(&nh->potential_list, nh->thread_potential_pairs, nThreads);
+		nh->is_half = is_half;
+	}
+}
+
+// function that checks the pair of particles (i,j), checked once by the search, and adds it to the neighborhoods nh
+// the pair is added to both rows of the list, or once with the half lists, and once to the potential_list when the verlet algorithm is used
+void neighborhood_push_pair(neighborhood_options* options, neighborhood* nh, GLfloat(* data)[DATA_COLUMNS], int i, int j, const double period[DIMENSION], double L) {
+	double offset[DIMENSION];
+	double squared = particle_offset(data[i], data[j], period, offset);
+	double kh = pair_kh(options, i, j);
+	if (squared <= kh * kh && options->use_half_lists)
+		pairs_push(&nh->list_pairs, i, j, sqrt(squared), offset);
+	else if (squared <= kh * kh)
+		pairs_push_both(&nh->list_pairs, i, j, sqrt(squared), offset);
+	if (options->use_verlet && squared <= (kh + L) * (kh + L))
+		pairs_push(&nh->potential_pairs, i, j, sqrt(squared), offset);
+}
+
+// function that sorts the particles into levels of cells according to their own radius options->particle_kh
+// the cells of the level 0 are at least kh_min+L wide, and the ones of the level m are 2^m times wider, the last level being wide enough for kh_max+L;
+// each particle is put in the first level whose cells are wider than its own radius plus L, and the levels are only made of the cells
+// of the square grid, since the cells of the hash table could not be found from a particle of another level
+void neighborhood_levels_fill(neighborhood_options* options, GLfloat(* data)[DATA_COLUMNS], double L) {
+	double* particle_kh = options->particle_kh;
+	if (!options->particle_level) {
+		options->particle_level = malloc(options->capacity * sizeof(int));
+		CHECK_MALLOC(options->particle_level);
+	}
+	double kh_min = particle_kh[0];
+	double kh_max = particle_kh[0];
+	for (int i = 1; i < options->nPoints; i++) {
+		kh_min = fmin(kh_min, particle_kh[i]);
+		kh_max = fmax(kh_max, particle_kh[i]);
+	}
+	double width[MAX_LEVELS];
+	int nLevels = 1;
+	width[0] = kh_min + L;
+	while (width[nLevels - 1] < kh_max + L && nLevels < MAX_LEVELS) {
+		width[nLevels] = 2 * width[nLevels - 1];
+		nLevels++;
+	}
+	width[nLevels - 1] = fmax(width[nLevels - 1], kh_max + L);
+	options->nLevels = nLevels;
+	for (int i = 0; i < options->nPoints; i++) {
+		int level = 0;
+		while (width[level] < particle_kh[i] + L)
+			level++;
+		options->particle_level[i] = level;
+	}
+	for (int m = 0; m < nLevels; m++) {
+		cell_grid* grid = &options->levels[m];
+		int size = 1;
+		if (options->use_cells) {
+			size = (int)(2 * options->half_length / width[m]);
+			size = size < 1 ? 1 : size;
+		}
+		cell_grid_resize(grid, options->nPoints, size, 1, options->periodic);
+		grid->nThreads = neighborhood_threads(options);
+#pragma omp parallel for num_threads(cell_grid_threads(grid)) schedule(static)
+		for (int i = 0; i < options->nPoints; i++)
+			grid->cellNumber[i] = options->particle_level[i] == m ? cell_grid_locate(grid, data[i], options->half_length) : -1;
+		cell_grid_sort(grid);
+	}
+}
+
+// function that fills the neighborhoods nh when every particle has its own radius, with the levels of cells of neighborhood_levels_fill
+// a particle checks the particles of its own level with the half stencil, then the particles of each coarser level with the full stencil
+// of the cell of this level containing it, so that each pair is checked once, by its particle of the finest level:
+// the particles with a small radius only check the few particles with a large radius in the wide cells, and the other ones in the narrow cells
+// the potential_list only contains each pair once, as with neighborhood_search_half
+void neighborhood_search_levels(neighborhood_options* options, neighborhood* nh, GLfloat(* data)[DATA_COLUMNS], double L) {
+	neighborhood_levels_fill(options, data, L);
+	int nLevels = options->nLevels;
+	double period[DIMENSION];
+	neighborhood_period(options, period);
+	// the levels have one cell per search radius, so that their stencils have STENCIL_SIZE cells
+	int stencil[MAX_LEVELS][STENCIL_SIZE];
+	for (int m = 0; m < nLevels; m++)
+		cell_grid_stencil(&options->levels[m], stencil[m], 0);
+	for (int m = 0; m < nLevels; m++) {
+		cell_grid* grid = &options->levels[m];
+		int* cellStart = grid->cellStart;
+		int* cellParticles = grid->cellParticles;
+		// with less than 3 cells along a periodic axis, a cell is both before and after another one, so that the full stencil is used
+		// and each pair is only kept by its particle of smaller index
+		int is_small = 0;
+		for (int d = 0; d < DIMENSION; d++)
+			is_small |= options->periodic[d] && grid->size < 3;
+		int half_stencil[STENCIL_SIZE];
+		int nHalf = cell_grid_stencil(grid, half_stencil, !is_small);
+		for (int this_cell_number = 0; this_cell_number < grid->nActive; this_cell_number++) {
+			for (int a = cellStart[this_cell_number]; a < cellStart[this_cell_number + 1]; a++) {
+				int index_i = cellParticles[a];
+				for (int s = 0; s < nHalf; s++) {
+					int checking_cell_number = CELL_NEIGHBOUR(grid, this_cell_number, half_stencil, s);
+					// in its own cell, a particle only checks the particles after it
+					int b = s == 0 && !is_small ? a + 1 : cellStart[checking_cell_number];
+					for (; b < cellStart[checking_cell_number + 1]; b++) {
+						int index_j = cellParticles[b];
+						if (is_small && index_j <= index_i)
+							continue;
+						neighborhood_push_pair(options, nh, data, index_i, index_j, period, L);
 					}
 				}
-				else if (this_cell_number < size * size) {
-					checking_cell_number = find_next_cell(this_cell_number, checked_cells, size, use_improved_method);
-					while (checking_cell_number != -1 && !cellArray[checking_cell_number].nResident && !cellArray[checking_cell_number].ResidentList)
-						checking_cell_number = find_next_cell(this_cell_number, ++checked_cells, size, use_improved_method);
-					if (checking_cell_number != -1) {
-						checking_cell = cellArray[checking_cell_number];
-						checking_node = checking_cell.ResidentList[0];
+				for (int n = m + 1; n < nLevels; n++) {
+					cell_grid* coarse = &options->levels[n];
+					int coarse_cell_number = cell_grid_locate(coarse, data[index_i], options->half_length);
+					for (int s = 0; s < STENCIL_SIZE; s++) {
+						int checking_cell_number = CELL_NEIGHBOUR(coarse, coarse_cell_number, stencil[n], s);
+						for (int b = coarse->cellStart[checking_cell_number]; b < coarse->cellStart[checking_cell_number + 1]; b++) {
+							int index_j = coarse->cellParticles[b];
+							neighborhood_push_pair(options, nh, data, index_i, index_j, period, L);
+						}
 					}
 				}
 			}
-			if (use_improved_method && !(use_verlet && iterations)) {
-				j_check = i;
-				j = i + 1;
+		}
+	}
+	neighbours_build(options->use_half_lists ? &nh->half_list : &nh->list, &nh->list_pairs);
+	if (options->use_verlet) {
+		neighbours_build(&nh->potential_list, &nh->potential_pairs);
+		nh->is_half = 1;
+	}
+}
+
+// function to make sure the tree can contain nPoints particles and nNodes nodes
+void kd_tree_reserve(kd_tree* tree, int nPoints, int nNodes) {
+	if (nPoints > tree->nPoints) {
+		tree->nPoints = particle_capacity(tree->nPoints, nPoints);
+		tree->treeParticles = realloc(tree->treeParticles, tree->nPoints * sizeof(int));
+		CHECK_MALLOC(tree->treeParticles);
+	}
+	if (nNodes > tree->nodeCapacity) {
+		tree->nodeBegin = realloc(tree->nodeBegin, nNodes * sizeof(int));
+		CHECK_MALLOC(tree->nodeBegin);
+		tree->nodeEnd = realloc(tree->nodeEnd, nNodes * sizeof(int));
+		CHECK_MALLOC(tree->nodeEnd);
+		tree->lower = realloc(tree->lower, nNodes * sizeof(tree->lower[0]));
+		CHECK_MALLOC(tree->lower);
+		tree->upper = realloc(tree->upper, nNodes * sizeof(tree->upper[0]));
+		CHECK_MALLOC(tree->upper);
+		tree->nodeKh = realloc(tree->nodeKh, nNodes * sizeof(double));
+		CHECK_MALLOC(tree->nodeKh);
+		tree->nodeCapacity = nNodes;
+	}
+}
+
+// function that computes the box of the particles of the node, and their largest radius when every particle has its own radius
+// the box of a node without any particle is empty, so that it is never visited
+void kd_tree_box(kd_tree* tree, GLfloat(* data)[DATA_COLUMNS], double* particle_kh, int node) {
+	GLfloat* lower = tree->lower[node];
+	GLfloat* upper = tree->upper[node];
+	for (int d = 0; d < DIMENSION; d++) {
+		lower[d] = FLT_MAX;
+		upper[d] = -FLT_MAX;
+	}
+	tree->nodeKh[node] = 0.0;
+	for (int b = tree->nodeBegin[node]; b < tree->nodeEnd[node]; b++) {
+		int index = tree->treeParticles[b];
+		for (int d = 0; d < DIMENSION; d++) {
+			lower[d] = fminf(lower[d], data[index][d]);
+			upper[d] = fmaxf(upper[d], data[index][d]);
+		}
+		if (particle_kh)
+			tree->nodeKh[node] = fmax(tree->nodeKh[node], particle_kh[index]);
+	}
+}
+
+// function that partially sorts the particles from begin to end-1 along the axis with a quickselect, so that the particle at the position k
+// is the one that would be there if they were sorted, the particles before it not being after it along the axis and conversely
+void kd_tree_select(int* particles, int begin, int end, int k, GLfloat(* data)[DATA_COLUMNS], int axis) {
+	while (end - begin > 1) {
+		// the pivot is the median of the first, middle and last particles
+		GLfloat first = data[particles[begin]][axis];
+		GLfloat middle = data[particles[begin + (end - begin) / 2]][axis];
+		GLfloat last = data[particles[end - 1]][axis];
+		GLfloat pivot = fmaxf(fminf(first, middle), fminf(fmaxf(first, middle), last));
+		int i = begin;
+		int j = end - 1;
+		while (i <= j) {
+			while (data[particles[i]][axis] < pivot)
+				i++;
+			while (data[particles[j]][axis] > pivot)
+				j--;
+			if (i <= j) {
+				int swap = particles[i];
+				particles[i++] = particles[j];
+				particles[j--] = swap;
 			}
 		}
-		i_check = i;
-		if ((!(use_verlet && iterations) && use_cells && checking_cell_number == -1) || (use_verlet && iterations && !are_still_neighbours)) {
-			i++;
-			j_check = j;
+		// the particles from j+1 to i-1 are all at the pivot
+		if (k <= j)
+			end = j + 1;
+		else if (k >= i)
+			begin = i;
+		else
+			return;
+	}
+}
+
+// function that computes the box of the node, whose particles are already stored from nodeBegin to nodeEnd-1 in treeParticles,
+// then splits them in two halves along the longest side of the box, giving their particles to its two children
+void kd_tree_build_node(kd_tree* tree, GLfloat(* data)[DATA_COLUMNS], double* particle_kh, int node) {
+	kd_tree_box(tree, data, particle_kh, node);
+	if (node >= (1 << tree->depth) - 1)
+		return;
+	int axis = 0;
+	for (int d = 1; d < DIMENSION; d++)
+		if (tree->upper[node][d] - tree->lower[node][d] > tree->upper[node][axis] - tree->lower[node][axis])
+			axis = d;
+	int begin = tree->nodeBegin[node];
+	int end = tree->nodeEnd[node];
+	int middle = begin + (end - begin) / 2;
+	kd_tree_select(tree->treeParticles, begin, end, middle, data, axis);
+	tree->nodeBegin[2 * node + 1] = begin;
+	tree->nodeEnd[2 * node + 1] = middle;
+	tree->nodeBegin[2 * node + 2] = middle;
+	tree->nodeEnd[2 * node + 2] = end;
+}
+
+// function that builds the tree of all the particles with nThreads threads; the arrays are only reallocated when they are too small
+// particle_kh : radius of each particle, NULL if every particle uses the same radius
+void kd_tree_build(kd_tree* tree, GLfloat(* data)[DATA_COLUMNS], int nPoints, double* particle_kh, int nThreads) {
+	int depth = 0;
+	while (((nPoints + (1 << depth) - 1) >> depth) > tree->leafSize)
+		depth++;
+	tree->depth = depth;
+	tree->nNodes = (2 << depth) - 1;
+	kd_tree_reserve(tree, nPoints, tree->nNodes);
+	for (int i = 0; i < nPoints; i++)
+		tree->treeParticles[i] = i;
+	tree->nodeBegin[0] = 0;
+	tree->nodeEnd[0] = nPoints;
+	// the nodes of a level have their own particles, so that they are built by the threads in parallel, one level after the other
+	for (int level = 0; level <= depth; level++) {
+#pragma omp parallel for num_threads(nThreads) schedule(dynamic, 1)
+		for (int node = (1 << level) - 1; node < (2 << level) - 1; node++)
+			kd_tree_build_node(tree, data, particle_kh, node);
+	}
+	tree->refits = 0;
+}
+
+// function that updates the boxes of the nodes with the new positions of the particles, without changing the nodes containing them
+// the leaves are refitted by nThreads threads, then each node gets the union of the boxes of its children
+void kd_tree_refit(kd_tree* tree, GLfloat(* data)[DATA_COLUMNS], double* particle_kh, int nThreads) {
+	int first_leaf = (1 << tree->depth) - 1;
+#pragma omp parallel for num_threads(nThreads) schedule(static)
+	for (int node = first_leaf; node < tree->nNodes; node++)
+		kd_tree_box(tree, data, particle_kh, node);
+	for (int node = first_leaf - 1; node >= 0; node--) {
+		for (int d = 0; d < DIMENSION; d++) {
+			tree->lower[node][d] = fminf(tree->lower[2 * node + 1][d], tree->lower[2 * node + 2][d]);
+			tree->upper[node][d] = fmaxf(tree->upper[2 * node + 1][d], tree->upper[2 * node + 2][d]);
+		}
+		tree->nodeKh[node] = fmax(tree->nodeKh[2 * node + 1], tree->nodeKh[2 * node + 2]);
+	}
+	tree->refits++;
+}
+
+// function that returns the squared distance between position and the box of the node, 0 if it is inside of it
+// period : length of the domain along each axis, 0 if it is not periodic; the closest image of position is then used
+double kd_tree_box_distance(kd_tree* tree, int node, GLfloat* position, const double period[DIMENSION]) {
+	double squared = 0.0;
+	for (int d = 0; d < DIMENSION; d++) {
+		double lower = tree->lower[node][d];
+		double upper = tree->upper[node][d];
+		double x = position[d];
+		double gap = fmax(fmax(lower - x, x - upper), 0.0);
+		if (period[d] > 0.0) {
+			gap = fmin(gap, fmax(fmax(lower - (x + period[d]), x + period[d] - upper), 0.0));
+			gap = fmin(gap, fmax(fmax(lower - (x - period[d]), x - period[d] - upper), 0.0));
 		}
-		if (j != j_check) {
-			int index_i, index_j;
-			if (use_verlet && iterations) {
-				index_j = checking_neighbours.index;
-				index_i = i;
+		squared += gap * gap;
+	}
+	return squared;
+}
+
+// function to properly free the arrays of the tree
+void kd_tree_delete(kd_tree* tree) {
+	free(tree->treeParticles);
+	free(tree->nodeBegin);
+	free(tree->nodeEnd);
+	free(tree->lower);
+	free(tree->upper);
+	free(tree->nodeKh);
+}
+
+// function that builds the tree again every max_refits+1 calls or when the number of particles changed, and only refits it in between
+void kd_tree_update(kd_tree* tree, GLfloat(* data)[DATA_COLUMNS], int nPoints, double* particle_kh, int nThreads) {
+	if (tree->nNodes && tree->nodeEnd[0] == nPoints && tree->refits < tree->max_refits)
+		kd_tree_refit(tree, data, particle_kh, nThreads);
+	else
+		kd_tree_build(tree, data, nPoints, particle_kh, nThreads);
+}
+
+// function that fills the neighborhoods nh with the kd-tree of the particles, shared between nThreads threads as with neighborhood_search_full
+// the tree is built again every max_refits+1 searches and only refitted in between; every particle visits the nodes whose box is closer
+// than its radius plus L, so that the number of particles checked does not depend on their clustering
+void neighborhood_search_tree(neighborhood_options* options, neighborhood* nh, GLfloat(* data)[DATA_COLUMNS], double L, int nThreads) {
+	kd_tree* tree = &options->tree;
+	double* particle_kh = options->particle_kh;
+	kd_tree_update(tree, data, options->nPoints, particle_kh, nThreads);
+	tree->is_active = 1;
+	int use_verlet = options->use_verlet;
+	// with the half lists, each pair is only kept by its particle of smaller index
+	int is_half = options->use_half_lists;
+	int first_leaf = (1 << tree->depth) - 1;
+	double period[DIMENSION];
+	neighborhood_period(options, period);
+	neighborhood_threads_reserve(nh, nThreads);
+#pragma omp parallel num_threads(nThreads)
+	{
+		int t = 0;
+#ifdef _OPENMP
+		t = omp_get_thread_num();
+#endif
+		neighbour_pairs* list_pairs = &nh->thread_list_pairs[t];
+		neighbour_pairs* potential_pairs = &nh->thread_potential_pairs[t];
+		// the tree is balanced, so that a depth-first traversal never stores more than depth+1 nodes
+		int stack[64];
+#pragma omp for schedule(dynamic, 64)
+		for (int a = 0; a < options->nPoints; a++) {
+			// the particles are visited in the order of the leaves, so that consecutive particles visit the same nodes
+			int index_i = tree->treeParticles[a];
+			double kh_i = particle_kh ? particle_kh[index_i] : options->kh;
+			int nStack = 0;
+			stack[nStack++] = 0;
+			while (nStack) {
+				int node = stack[--nStack];
+				double bound = kh_i;
+				if (particle_kh)
+					bound = options->pair_criterion == KH_MEAN ? 0.5 * (kh_i + tree->nodeKh[node]) : fmax(kh_i, tree->nodeKh[node]);
+				bound += L;
+				if (kd_tree_box_distance(tree, node, data[index_i], period) > bound * bound)
+					continue;
+				if (node < first_leaf) {
+					stack[nStack++] = 2 * node + 2;
+					stack[nStack++] = 2 * node + 1;
+					continue;
+				}
+				for (int b = tree->nodeBegin[node]; b < tree->nodeEnd[node]; b++) {
+					int index_j = tree->treeParticles[b];
+					if (index_j == index_i || (is_half && index_j < index_i))
+						continue;
+					double offset[DIMENSION];
+					double squared = particle_offset(data[index_i], data[index_j], period, offset);
+					double kh = pair_kh(options, index_i, index_j);
+					if (squared <= kh * kh)
+						pairs_push(list_pairs, index_i, index_j, sqrt(squared), offset);
+					if (use_verlet && squared <= (kh + L) * (kh + L))
+						pairs_push(potential_pairs, index_i, index_j, sqrt(squared), offset);
+				}
 			}
-			else if (use_cells) {
-				index_j = checking_node.index;
-				index_i = this_node.index;
+		}
+	}
+	neighbours_merge(is_half ? &nh->half_list : &nh->list, nh->thread_list_pairs, nThreads);
+	if (use_verlet) {
+		neighbours_merge(&nh->potential_list, nh->thread_potential_pairs, nThreads);
+		nh->is_half = is_half;
+	}
+}
+
+// function that returns 1 + (variance of the occupancy of the cells - mean occupancy)/(mean occupancy)^2, which is also the mean number of other particles
+// in the cell of a particle divided by the mean number of particles in a cell: close to 1 for uniformly distributed particles, whatever the width
+// of the cells, since the variance of a uniform occupancy is its mean, and large when they are clustered
+// only the cells that can contain particles are counted, that is the cells of the domain for the square grid and the occupied ones for the hash table
+double cell_grid_clustering(cell_grid* grid) {
+	double sum = 0.0;
+	for (int c = 0; c < grid->nActive; c++) {
+		double occupancy = grid->cellStart[c + 1] - grid->cellStart[c];
+		sum += occupancy * (occupancy - 1);
+	}
+	double nCells = grid->is_hashed ? grid->nOccupied : pow(grid->size, DIMENSION);
+	return grid->nParticles ? sum * nCells / ((double)grid->nParticles * grid->nParticles) : 1.0;
+}
+
+// function that returns the mean number of other particles per unit of volume around a particle, estimated from the occupancy of the cells
+// of nSamples particles drawn at random among the ones of the grid; the mean is weighted by the particles, so that it grows with
+// the clustering of the particles instead of staying the mean density of the domain, as the number of neighbours does
+// the samples are drawn rather than taken at regular steps, which could only pick the particles of a regular pattern of the indices
+// width : length of the side of the cells
+double cell_grid_density(cell_grid* grid, int nSamples, double width) {
+	unsigned int seed = (unsigned int)grid->nParticles;
+	double others = 0.0;
+	int nCounted = 0;
+	for (int s = 0; s < nSamples && grid->nParticles; s++) {
+		int i = (int)(random_uniform(&seed) * grid->nParticles);
+		int c = grid->cellNumber[i];
+		if (c < 0)
+			continue;
+		others += grid->cellStart[c + 1] - grid->cellStart[c] - 1;
+		nCounted++;
+	}
+	// at least one other particle is assumed, so that the estimate stays finite when the sampled cells only contain their own particle
+	return fmax(others, 1.0) / (nCounted ? nCounted : 1) / pow(width, DIMENSION);
+}
+
+// function that sorts the particles into the cells of options->grid, which are at least (kh+L)/subdivision wide, and returns their number per row
+// the hash table is used when options->use_hashing is set, unless the domain is periodic; without cells, the grid only has one cell
+int neighborhood_fill_grid(neighborhood_options* options, GLfloat(* data)[DATA_COLUMNS], double L) {
+	options->grid.nThreads = neighborhood_threads(options);
+	int is_periodic = 0;
+	for (int d = 0; d < DIMENSION; d++)
+		is_periodic |= options->periodic[d];
+	int size = 1;
+	int subdivision = options->use_cells ? options->subdivision : 1;
+	options->grid.skip_corners = options->skip_corners;
+	options->grid.is_sorted = options->use_sorted_cells;
+	if (options->use_cells && options->use_hashing && !is_periodic)
+		cell_grid_fill_hashed(&options->grid, data, options->nPoints, (options->kh + L) / subdivision, subdivision);
+	else {
+		if (options->use_cells) {
+			size = (int)(2 * options->half_length * subdivision / (options->kh + L));
+			size = size < 1 ? 1 : size;
+		}
+		cell_grid_fill(&options->grid, data, options->nPoints, size, subdivision, options->half_length, options->periodic);
+	}
+	return size;
+}
+
+// function that fills the neighborhoods nh by checking the distances between the particles of neighbouring cells
+// the cells are at least (kh+L)/subdivision wide, so that all the potential neighbours of a particle are in the stencil of the
+// subdivision cells around its own one; without cells, the grid is made of a single cell containing all the particles
+// the potential_list is filled as well when the verlet algorithm is used
+// the half stencil is only used by a single thread, since the pairs it finds are added to two rows, and when the grid has at least
+// 2*subdivision+1 cells along the periodic axes, since a cell would otherwise be both before and after another one
+// when every particle has its own radius, the levels of cells of neighborhood_search_levels are used instead, by a single thread
+// the kd-tree of neighborhood_search_tree is used instead of the cells with BACKEND_TREE, or with BACKEND_AUTO when the occupancy
+// of the cells shows that the particles are clustered
+void neighborhood_search(neighborhood_options* options, neighborhood* nh, GLfloat(* data)[DATA_COLUMNS], int nThreads) {
+	double L = 0.0;
+	if (options->use_verlet) {
+		L = options->L;
+	}
+	if (options->backend == BACKEND_TREE) {
+		neighborhood_search_tree(options, nh, data, L, nThreads);
+		return;
+	}
+	options->tree.is_active = 0;
+	if (options->particle_kh) {
+		neighborhood_search_levels(options, nh, data, L);
+		return;
+	}
+	int is_periodic = 0;
+	for (int d = 0; d < DIMENSION; d++)
+		is_periodic |= options->periodic[d];
+	int size = neighborhood_fill_grid(options, data, L);
+	int is_small = is_periodic && size < 2 * options->grid.subdivision + 1;
+	if (options->backend == BACKEND_AUTO && options->use_cells && cell_grid_clustering(&options->grid) > options->tree_threshold) {
+		neighborhood_search_tree(options, nh, data, L, nThreads);
+		return;
+	}
+	if (options->use_half_stencil && nThreads == 1 && !options->use_half_lists && !is_small)
+		neighborhood_search_half(options, nh, data, L);
+	else
+		neighborhood_search_full(options, nh, data, L, nThreads);
+}
+
+// function that fills cells with the cells of the full stencil around position, which may be any point of the space, and returns their number
+// with the hash table, the cells that are not occupied are replaced by the empty cell nOccupied
+int cell_grid_probe_cells(cell_grid* grid, GLfloat* position, int half_length, int cells[MAX_STENCIL_SIZE]) {
+	if (grid->is_hashed) {
+		int center[DIMENSION];
+		for (int d = 0; d < DIMENSION; d++)
+			center[d] = (int)floor(position[d] / grid->width);
+		int nCells = 0;
+		for (int s = 0; s < grid->nStencil; s++) {
+			if (grid->skip_corners && cell_grid_is_corner(grid, s))
+				continue;
+			int cell[DIMENSION];
+			cell_grid_stencil_offset(grid, s, cell);
+			for (int d = 0; d < DIMENSION; d++)
+				cell[d] += center[d];
+			int slot = cell_grid_hash_slot(grid, cell);
+			cells[nCells++] = grid->hashCells[slot] == -1 ? grid->nOccupied : grid->hashCells[slot];
+		}
+		return nCells;
+	}
+	int stencil[MAX_STENCIL_SIZE];
+	int nCells = cell_grid_stencil(grid, stencil, 0);
+	int cell_number = cell_grid_locate(grid, position, half_length);
+	for (int s = 0; s < nCells; s++)
+		cells[s] = CELL_NEIGHBOUR(grid, cell_number, stencil, s);
+	return nCells;
+}
+
+// function that adds the particle j to the neighbours of the probe p at position when it is closer than its radius
+void neighborhood_probe_push(neighborhood_options* options, neighbour_pairs* pairs, GLfloat(* data)[DATA_COLUMNS], GLfloat* position, int p, int j, const double period[DIMENSION]) {
+	double offset[DIMENSION];
+	double squared = particle_offset(position, data[j], period, offset);
+	double kh = options->particle_kh ? options->particle_kh[j] : options->kh;
+	if (squared <= kh * kh)
+		pairs_push(pairs, p, j, sqrt(squared), offset);
+}
+
+// function that fills the list of probe_nh with the particles closer than their radius to each of the nProbes points probes, which may be anywhere
+// the rows of the list are the probes, and the displacements go from the probe to the particle; the radius is options->kh, or the own radius
+// of the particle when every particle has one, since the probes do not have any
+// the cells, levels of cells or kd-tree of the last search are used as they are, so that this function must be called after neighborhood_update:
+// they are still wide enough for the particles that moved by less than L/2 since then, as the verlet algorithm makes sure of
+// the probes are shared between the threads of options as with neighborhood_search_full
+void neighborhood_probe(neighborhood_options* options, neighborhood* probe_nh, GLfloat(* data)[DATA_COLUMNS], GLfloat(* probes)[DIMENSION], int nProbes) {
+	neighbours_resize(&probe_nh->list, nProbes);
+	probe_nh->nPoints = nProbes;
+	double L = options->use_verlet ? options->L : 0.0;
+	double period[DIMENSION];
+	neighborhood_period(options, period);
+	kd_tree* tree = &options->tree;
+	int first_leaf = (1 << tree->depth) - 1;
+	int nThreads = neighborhood_threads(options);
+	neighborhood_threads_reserve(probe_nh, nThreads);
+#pragma omp parallel num_threads(nThreads)
+	{
+		int t = 0;
+#ifdef _OPENMP
+		t = omp_get_thread_num();
+#endif
+		neighbour_pairs* pairs = &probe_nh->thread_list_pairs[t];
+		int cells[MAX_STENCIL_SIZE];
+		int stack[64];
+#pragma omp for schedule(dynamic, 64)
+		for (int p = 0; p < nProbes; p++) {
+			GLfloat* position = probes[p];
+			if (tree->is_active) {
+				int nStack = 0;
+				stack[nStack++] = 0;
+				while (nStack) {
+					int node = stack[--nStack];
+					double bound = (options->particle_kh ? tree->nodeKh[node] : options->kh) + L;
+					if (kd_tree_box_distance(tree, node, position, period) > bound * bound)
+						continue;
+					if (node < first_leaf) {
+						stack[nStack++] = 2 * node + 2;
+						stack[nStack++] = 2 * node + 1;
+						continue;
+					}
+					for (int b = tree->nodeBegin[node]; b < tree->nodeEnd[node]; b++)
+						neighborhood_probe_push(options, pairs, data, position, p, tree->treeParticles[b], period);
+				}
 			}
 			else {
-				index_j = j;
-				index_i = i;
-			}
-			double distance = sqrt((pow((double)data[index_j][0] - (double)data[index_i][0], 2) + pow((double)data[index_j][1] - (double)data[index_i][1], 2)));
-			if (distance <= kh && index_i != index_j) {
-				neighbours_new(index_j, nh, index_i, distance, !iterations, 0);
-				if (use_improved_method)
-					neighbours_new(index_i, nh, index_j, distance, 0, 0);
-			}
-			else if (use_verlet && !iterations && distance <= (kh + L) && index_i != index_j) {
-				neighbours_new(index_j, nh, index_i, distance, !iterations, 1);
-				if (use_improved_method)
-					neighbours_new(index_i, nh, index_j, distance, 0, 1);
-			}
-			if (use_verlet && iterations) {
-				if (checking_neighbours.next) {
-					checking_neighbours = *(checking_neighbours.next);
+				// with the levels of cells, every level is checked since each particle is only in the cells of its own level
+				int nGrids = options->particle_kh ? options->nLevels : 1;
+				for (int m = 0; m < nGrids; m++) {
+					cell_grid* grid = options->particle_kh ? &options->levels[m] : &options->grid;
+					int nCells = cell_grid_probe_cells(grid, position, options->half_length, cells);
+					for (int s = 0; s < nCells; s++)
+						for (int b = grid->cellStart[cells[s]]; b < grid->cellStart[cells[s] + 1]; b++)
+							neighborhood_probe_push(options, pairs, data, position, p, grid->cellParticles[b], period);
 				}
-				else
-					i++;
-			}
-			else if (use_cells)
-				if (checking_node.next)
-					checking_node = *(checking_node.next);
-				else {
-					checking_cell_number = find_next_cell(this_cell_number, ++checked_cells, size, use_improved_method);
-					while (checking_cell_number != -1 && !cellArray[checking_cell_number].nResident && !cellArray[checking_cell_number].ResidentList)
-						checking_cell_number = find_next_cell(this_cell_number, ++checked_cells, size, use_improved_method);
-					if (checking_cell_number != -1) {
-						checking_cell = cellArray[checking_cell_number];
-						checking_node = cellArray[checking_cell_number].ResidentList[0];
+			}
+		}
+	}
+	neighbours_merge(&probe_nh->list, probe_nh->thread_list_pairs, nThreads);
+}
+
+// function that calls visit for the pair of particles (i,j) when they are neighbours, j being different from i
+void neighborhood_visit_pair(neighborhood_options* options, GLfloat(* data)[DATA_COLUMNS], int i, int j, const double period[DIMENSION], pair_visitor visit, void* context) {
+	if (j == i)
+		return;
+	double offset[DIMENSION];
+	double squared = particle_offset(data[i], data[j], period, offset);
+	double kh = pair_kh(options, i, j);
+	if (squared <= kh * kh)
+		visit(context, i, j, sqrt(squared), offset);
+}
+
+// function that calls visit for every pair of neighbours found by the search, without storing them in any table
+// the cells of options->grid are used, or the kd-tree when the particles have their own radius or when the tree is already used by the search;
+// they are filled again with the current positions as neighborhood_update would do, so that neighborhood_probe can still use them
+// the particles are shared between the threads of options as with neighborhood_search_full, and each pair is visited twice,
+// once for each particle i, by the thread that owns i: visit may thus update the values of i without any lock, but not the ones of j
+void neighborhood_visit(neighborhood_options* options, GLfloat(* data)[DATA_COLUMNS], pair_visitor visit, void* context) {
+	double L = options->use_verlet ? options->L : 0.0;
+	int nThreads = neighborhood_threads(options);
+	double period[DIMENSION];
+	neighborhood_period(options, period);
+	double* particle_kh = options->particle_kh;
+	kd_tree* tree = &options->tree;
+	cell_grid* grid = &options->grid;
+	int use_tree = particle_kh || tree->is_active || options->backend == BACKEND_TREE;
+	int stencil[MAX_STENCIL_SIZE];
+	int nStencil = 0;
+	if (use_tree)
+		kd_tree_update(tree, data, options->nPoints, particle_kh, nThreads);
+	else {
+		neighborhood_fill_grid(options, data, L);
+		nStencil = cell_grid_stencil(grid, stencil, 0);
+	}
+	int first_leaf = (1 << tree->depth) - 1;
+#pragma omp parallel num_threads(nThreads)
+	{
+		int stack[64];
+#pragma omp for schedule(dynamic, 64)
+		for (int a = 0; a < options->nPoints; a++) {
+			if (use_tree) {
+				int index_i = tree->treeParticles[a];
+				double kh_i = particle_kh ? particle_kh[index_i] : options->kh;
+				int nStack = 0;
+				stack[nStack++] = 0;
+				while (nStack) {
+					int node = stack[--nStack];
+					double bound = kh_i;
+					if (particle_kh)
+						bound = options->pair_criterion == KH_MEAN ? 0.5 * (kh_i + tree->nodeKh[node]) : fmax(kh_i, tree->nodeKh[node]);
+					if (kd_tree_box_distance(tree, node, data[index_i], period) > bound * bound)
+						continue;
+					if (node < first_leaf) {
+						stack[nStack++] = 2 * node + 2;
+						stack[nStack++] = 2 * node + 1;
+						continue;
 					}
-					else
-						i++;
+					for (int b = tree->nodeBegin[node]; b < tree->nodeEnd[node]; b++)
+						neighborhood_visit_pair(options, data, index_i, tree->treeParticles[b], period, visit, context);
 				}
-			else
-				if (j == NPTS - 1 || (i == NPTS - 1 && (j == NPTS - 2 || use_improved_method))) {
-					i++;
+			}
+			else {
+				int index_i = grid->cellParticles[a];
+				int this_cell_number = grid->cellNumber[index_i];
+				for (int s = 0; s < nStencil; s++) {
+					int checking_cell_number = CELL_NEIGHBOUR(grid, this_cell_number, stencil, s);
+					for (int b = grid->cellStart[checking_cell_number]; b < grid->cellStart[checking_cell_number + 1]; b++)
+						neighborhood_visit_pair(options, data, index_i, grid->cellParticles[b], period, visit, context);
 				}
+			}
 		}
-		j_check = j;
-		if (use_improved_method) {
-			j++;
+	}
+}
+
+// function that returns the largest distance travelled by a particle since the last update of the potential_list
+double verlet_max_displacement(neighborhood_options* options, GLfloat(* data)[DATA_COLUMNS]) {
+	GLfloat(*positions)[DIMENSION] = options->verlet_positions;
+	double period[DIMENSION];
+	neighborhood_period(options, period);
+	double max_distance = 0.0;
+	// a particle that went through a periodic boundary has only travelled to the closest image of its previous position
+	for (int i = 0; i < options->nPoints; i++)
+		max_distance = fmax(max_distance, particle_distance(positions[i], data[i], period));
+	return max_distance;
+}
+
+// function that returns the wall-clock time in seconds, used to measure the cost of the iterations
+// without OpenMP, the processor time is used instead, which is the same for a single thread
+double wall_time() {
+#ifdef _OPENMP
+	return omp_get_wtime();
+#else
+	return (double)clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+// function called before each update of the potential_list to choose the length L of the next verlet cycle
+// the cost per iteration of the cycle that just ended is compared to the best one, then the next length to try is set in L
+// tuner : state of the autotuning
+// L : length used during the cycle that just ended, replaced by the length to use during the next one
+// kh : size of the radius of the influence circle of a particle, used to bound L
+void verlet_tuner_update(verlet_tuner* tuner, double* L, double kh) {
+	if (tuner->cycle_steps) {
+		double cost = tuner->cycle_time / tuner->cycle_steps;
+		if (tuner->candidate < tuner->nCandidates) {
+			if (tuner->candidate == 0 || cost < tuner->best_cost) {
+				tuner->best_cost = cost;
+				tuner->best_L = *L;
+			}
+			tuner->candidate++;
+		}
+		else if (tuner->probing) {
+			if (cost < tuner->best_cost) {
+				tuner->best_cost = cost;
+				tuner->best_L = *L;
+			}
+			else
+				tuner->direction = -tuner->direction;
+			tuner->probing = 0;
+			tuner->cycles = 0;
+		}
+		else {
+			// the cost of the best length is averaged, so that it follows the changes of density of the simulation
+			tuner->best_cost = 0.5 * (tuner->best_cost + cost);
+			tuner->cycles++;
 		}
+	}
+	else
+		tuner->reference_L = *L;
+	tuner->cycle_time = 0.0;
+	tuner->cycle_steps = 0;
+
+	if (tuner->candidate < tuner->nCandidates)
+		*L = tuner->reference_L * pow(tuner->factor, tuner->candidate - tuner->nCandidates / 2);
+	else if (tuner->cycles >= tuner->period) {
+		tuner->probing = 1;
+		*L = tuner->best_L * pow(tuner->factor, tuner->direction);
+	}
+	else
+		*L = tuner->best_L;
+	*L = fmin(fmax(*L, 0.01 * kh), kh);
+}
+
+// function to make sure the arrays of the particles of options can contain nPoints particles, with the capacity given by particle_capacity
+void neighborhood_reserve_particles(neighborhood_options* options, int nPoints) {
+	if (nPoints <= options->capacity)
+		return;
+	int capacity = particle_capacity(options->capacity, nPoints);
+	options->verlet_positions = realloc(options->verlet_positions, capacity * sizeof(options->verlet_positions[0]));
+	CHECK_MALLOC(options->verlet_positions);
+	options->reorder.particle_id = realloc(options->reorder.particle_id, capacity * sizeof(int));
+	CHECK_MALLOC(options->reorder.particle_id);
+	if (options->particle_kh) {
+		options->particle_kh = realloc(options->particle_kh, capacity * sizeof(double));
+		CHECK_MALLOC(options->particle_kh);
+	}
+	if (options->particle_level) {
+		options->particle_level = realloc(options->particle_level, capacity * sizeof(int));
+		CHECK_MALLOC(options->particle_level);
+	}
+	if (options->particle_origin) {
+		options->particle_origin = realloc(options->particle_origin, capacity * sizeof(int));
+		CHECK_MALLOC(options->particle_origin);
+	}
+	options->capacity = capacity;
+}
+
+// function called before the first particle is added or removed since the last update, so that particle_origin keeps track of the moves
+void neighborhood_begin_resize(neighborhood_options* options) {
+	if (options->is_resized)
+		return;
+	if (!options->particle_origin) {
+		options->particle_origin = malloc(options->capacity * sizeof(int));
+		CHECK_MALLOC(options->particle_origin);
+	}
+	for (int i = 0; i < options->nPoints; i++)
+		options->particle_origin[i] = i;
+	options->nPrevious = options->nPoints;
+	options->is_resized = 1;
+}
+
+// function that gives options->nPoints rows to the neighborhoods nh, once some particles were added or removed since the last update
+// the cells, the tree and the potential_list contain the previous indices, so that the update must search again; only the pairs
+// of the previous iteration are kept, renumbered with the new indices, so that they can still be compared with the new ones
+void neighborhood_resize(neighborhood_options* options, neighborhood* nh) {
+	nh->nPoints = options->nPoints;
+	neighbours_resize(&nh->list, options->nPoints);
+	neighbours_resize(&nh->half_list, options->nPoints);
+	neighbours_resize(&nh->potential_list, options->nPoints);
+	neighbours_resize(&nh->pair_buffer, options->nPoints);
+	// the pairs of the removed particles are dropped without being reported
+	if (options->use_pair_changes) {
+		int* slot = malloc((options->nPrevious + 1) * sizeof(int));
+		CHECK_MALLOC(slot);
+		for (int k = 0; k < options->nPrevious; k++)
+			slot[k] = -1;
+		for (int i = 0; i < options->nPoints; i++)
+			if (options->particle_origin[i] >= 0)
+				slot[options->particle_origin[i]] = i;
+		neighbours_renumber(&nh->pair_list, &nh->list_pairs, slot, options->nPoints);
+		neighbours_sort_pairs(&nh->pair_list, &nh->pair_list, 1, &nh->list_pairs);
+		free(slot);
+	}
+	else
+		neighbours_resize(&nh->pair_list, options->nPoints);
+	// the previous order of the sorted grid and the nodes of the tree contain the previous indices, so that the tree is built again
+	options->grid.nOrdered = 0;
+	options->tree.nNodes = 0;
+	options->is_resized = 0;
+}
+
+// function that estimates the mean number of neighbours of the particles with the current kh from the occupancy of the cells, stores it in
+// options->estimated_neighbours and returns the radius giving options->target_neighbours neighbours instead, see cell_grid_density
+// is_filled : int used as a boolean; options->grid was filled with the current positions by a search of the cells, otherwise the particles are
+//             first sorted into the cells the search would use, or into the cells of the square grid kh+L wide when the search uses no cells
+double neighborhood_estimate_kh(neighborhood_options* options, GLfloat(* data)[DATA_COLUMNS], int is_filled) {
+	cell_grid* grid = &options->grid;
+	double L = options->use_verlet ? options->L : 0.0;
+	if (!options->use_cells || options->backend == BACKEND_TREE) {
+		int size = (int)(2 * options->half_length / (options->kh + L));
+		grid->nThreads = neighborhood_threads(options);
+		cell_grid_fill(grid, data, options->nPoints, size < 1 ? 1 : size, 1, options->half_length, options->periodic);
+	}
+	else if (!is_filled)
+		neighborhood_fill_grid(options, data, L);
+	double width = grid->is_hashed ? grid->width : 2.0 * options->half_length / grid->size;
+	double density = cell_grid_density(grid, options->kh_samples, width);
+#if DIMENSION == 3
+	double volume = 4.0 / 3.0 * M_PI;
+#else
+	double volume = M_PI;
+#endif
+	options->estimated_neighbours = density * volume * pow(options->kh, DIMENSION);
+	double kh = pow(options->target_neighbours / (density * volume), 1.0 / DIMENSION);
+	// kh can not be wider than the domain, nor than half_length along a periodic axis
+	double max_kh = 2.0 * options->half_length * sqrt(DIMENSION);
+	for (int d = 0; d < DIMENSION; d++)
+		if (options->periodic[d])
+			max_kh = options->half_length - L;
+	return fmin(kh, max_kh);
+}
+
+// function that changes options->kh to the one giving options->target_neighbours neighbours when the estimate of neighborhood_estimate_kh is
+// more than options->kh_tolerance times the target, or less than the target over kh_tolerance, or when kh was never estimated, and returns 1 if it did
+// the cells filled for the new kh are closer to its scale, so that the estimate is repeated with them, up to 3 times: the first estimate
+// is much too low when the cells are wider than the clusters of particles
+// is_filled : int used as a boolean; options->grid was filled with the current positions by a search of the cells
+int neighborhood_adapt_kh(neighborhood_options* options, GLfloat(* data)[DATA_COLUMNS], int is_filled) {
+	int is_estimated = options->estimated_neighbours != 0.0;
+	int is_changed = 0;
+	for (int estimates = 0; estimates < 3; estimates++) {
+		double kh = neighborhood_estimate_kh(options, data, is_filled);
+		double ratio = options->estimated_neighbours / options->target_neighbours;
+		if (is_estimated && ratio <= options->kh_tolerance && ratio * options->kh_tolerance >= 1.0)
+			break;
+		options->kh = kh;
+		is_estimated = 1;
+		is_changed = 1;
+		is_filled = 0;
+	}
+	return is_changed;
+}
+
+void neighborhood_update(neighborhood_options* options, neighborhood* nh, GLfloat(* data)[DATA_COLUMNS], int iterations) {
+	double begin = wall_time();
+	int step = iterations;
+	int use_autotune = options->use_verlet && options->tuner.use_autotune;
+	int use_adaptive_kh = options->use_adaptive_kh && !options->particle_kh;
+	int is_resized = options->is_resized;
+	if (is_resized)
+		neighborhood_resize(options, nh);
+	// a pair can only get closer than kh if one of its particles has moved more than L/2 since the potential_list was filled
+	if (!options->use_verlet || is_resized)
+		iterations = 0;
+	else if (options->use_displacement_trigger || use_autotune)
+		iterations = iterations && verlet_max_displacement(options, data) <= options->L / 2;
+	else
+		iterations = iterations % options->optimal_verlet_steps;
+
+	neighborhood_reset(nh, iterations);
+	if (use_autotune && !iterations)
+		verlet_tuner_update(&options->tuner, &options->L, options->kh);
+
+	int nThreads = neighborhood_threads(options);
+	if (options->use_verlet && iterations) {
+		if (options->use_half_lists || (nThreads > 1 && !nh->is_half))
+			neighborhood_filter_parallel(options, nh, data, nThreads);
 		else
-			j = (frameCount) % (NPTS - 1) + (int)(i <= ((frameCount) % (NPTS - 1)));
-		frameCount++;
-	}
-	if (use_cells)
-		cell_delete(cellArray, ceil(size) * ceil(size));
-}
-
-// function that returns which cell should be checked by a particle situated in this_cell
-// this_cell : number of the cell that contains the particle which the neighborhood is filled
-// checked_cell : number of cells that has already be completely checked for the current particle; serves as a first offset
-// size : number of cells in one row, so there are (size*size) cells
-// improve : serves as a second offset to avoid checking previous cells when the improved algorithm is activated
-int find_next_cell(int this_cell, int checked_cells, int size, int improve) {
-	if (this_cell == 0) {
-		if (checked_cells != 4)
-			return this_cell + checked_cells / 2 * size + checked_cells % 2;
-	}
-	else if (this_cell == size - 1) {
-		checked_cells += improve;
-		if (checked_cells != 4)
-			return this_cell - 1 + checked_cells / 2 * size + checked_cells % 2;
-	}
-	else if (this_cell == (size - 1) * size) {
-		checked_cells += 2 * improve;
-		if (checked_cells != 4)
-			return this_cell - size + checked_cells / 2 * size + checked_cells % 2;
-	}
-	else if (this_cell == size * size - 1) {
-		checked_cells += 3 * improve;
-		if (checked_cells < 4)
-			return this_cell - size - 1 + checked_cells / 2 * size + checked_cells % 2;
-	}
-	else if (this_cell / size == 0) {
-		checked_cells += improve;
-		if (checked_cells != 6)
-			return this_cell - 1 + checked_cells / 3 * size + checked_cells % 3;
-	}
-	else if (this_cell / size == size - 1) {
-		checked_cells += 4 * improve;
-		if (checked_cells != 6)
-			return this_cell - size - 1 + checked_cells / 3 * size + checked_cells % 3;
-	}
-	else if (this_cell % size == 0) {
-		checked_cells += 2 * improve;
-		if (checked_cells != 6)
-			return this_cell - size + checked_cells / 2 * size + checked_cells % 2;
-	}
-	else if (this_cell % size == size - 1) {
-		checked_cells += 3 * improve;
-		if (checked_cells != 6)
-			return this_cell - size - 1 + checked_cells / 2 * size + checked_cells % 2;
+			neighborhood_filter(options, nh, data);
 	}
 	else {
-		checked_cells += 4 * improve;
-		if (checked_cells != 9)
-			return this_cell - size - 1 + checked_cells / 3 * size + checked_cells % 3;
+		if (use_adaptive_kh && options->estimated_neighbours == 0.0)
+			neighborhood_adapt_kh(options, data, 0);
+		neighborhood_search(options, nh, data, nThreads);
+		// the neighbours cost quadratically in kh, so that kh is estimated again with the cells of each search, and the search done again when
+		// it changed; kh is first estimated before the first search, whose kh may otherwise give orders of magnitude more neighbours than the target
+		if (use_adaptive_kh && neighborhood_adapt_kh(options, data, options->use_cells && options->backend != BACKEND_TREE)) {
+			neighborhood_reset(nh, 0);
+			neighborhood_search(options, nh, data, nThreads);
+		}
+		if (options->use_verlet)
+			for (int i = 0; i < options->nPoints; i++)
+				memcpy(options->verlet_positions[i], data[i], sizeof(options->verlet_positions[0]));
+	}
+	// with the half lists, the list is only filled by neighborhood_transpose, when a full list is needed
+	if (options->use_half_lists) {
+		nh->list.size = 0;
+		memset(nh->list.start, 0, (nh->list.nRows + 1) * sizeof(int));
 	}
-	return -1;
+
+	if (options->reorder.steps && (options->grid.nActive || options->nLevels || options->tree.is_active) && step % options->reorder.steps == 0)
+		neighborhood_reorder(options, nh, data);
+
+	if (options->use_pair_changes)
+		neighborhood_changes(nh, options->use_half_lists ? &nh->half_list : &nh->list, options->use_half_lists);
+
+	if (options->use_verlet && options->use_compact_lists && !nh->is_compact)
+		neighborhood_compact(nh);
+
+	if (use_autotune) {
+		options->tuner.cycle_time += wall_time() - begin;
+		options->tuner.cycle_steps++;
+	}
+}
+
+// function that returns a pseudo-random number between 0 and 1 and moves seed to the next state of the generator,
+// so that every simulation has its own sequence instead of sharing the hidden state of rand
+double random_uniform(unsigned int* seed) {
+	*seed = *seed * 1103515245u + 12345u;
+	return (double)(*seed >> 8 & 0xFFFFFF) / 0x1000000;
 }
 
 //Changes the particle velocities randomly and updates the positions based, we assume elastic collisions with boundaries:
+//	-nPoints: number of particles in data
 //	-timestep: time intervals at which these are updated
-//	-xmin,xmax,ymin,ymax: boundaries of the domain
+//	-half_length: half of the length of the side of the domain, centered on the origin
 //	-maxspeed: the maximum speed that can be reached by the particles
+//	-periodic: axes along which the particles leaving the domain come back on the other side instead of bouncing
+//	-seed: state of the random generator of the simulation, see random_uniform
+// the speed along the axis d is stored in data[i][DIMENSION + d]
 
-void bouncyrandomupdate(GLfloat(* data)[8], double timestep, double half_length, double maxspeed) {
-	for (int i = 0; i < NPTS; i++) {
-		double speed = sqrtf(data[i][2] * data[i][2] + data[i][3] * data[i][3]);
-		data[i][0] += data[i][2] * timestep;
-		data[i][1] += data[i][3] * timestep;
-		data[i][2] += ((double)rand() / RAND_MAX - 0.5) * (0.05 * maxspeed) * timestep;
-		data[i][3] += ((double)rand() / RAND_MAX - 0.5) * (0.05 * maxspeed) * timestep;
+void bouncyrandomupdate(GLfloat(* data)[DATA_COLUMNS], int nPoints, double timestep, double half_length, double maxspeed, const int periodic[DIMENSION], unsigned int* seed) {
+	for (int i = 0; i < nPoints; i++) {
+		GLfloat* speed = &data[i][DIMENSION];
+		float norm = 0.0f;
+		for (int d = 0; d < DIMENSION; d++)
+			norm += speed[d] * speed[d];
+		norm = sqrtf(norm);
+		for (int d = 0; d < DIMENSION; d++)
+			data[i][d] += speed[d] * timestep;
+		for (int d = 0; d < DIMENSION; d++)
+			speed[d] += (random_uniform(seed) - 0.5) * (0.05 * maxspeed) * timestep;
 
-		if (speed > maxspeed) {//Slows down if speed too high
-			data[i][2] = data[i][2] * 0.9;
-			data[i][3] = data[i][3] * 0.9;
+		if (norm > maxspeed) {//Slows down if speed too high
+			for (int d = 0; d < DIMENSION; d++)
+				speed[d] = speed[d] * 0.9;
 		}
 
-		//This next part of the code handles the cases where a particle bounces of the wall
-
-		//Particle is too high in x
-		if (data[i][0] >= half_length) {
-			data[i][0] -= 2 * (data[i][0] - half_length);
-			data[i][2] = -data[i][2];
-		}
-		//Particle is too low in x
-		if (data[i][0] <= -half_length) {
-			data[i][0] -= 2 * (data[i][0] + half_length);
-			data[i][2] = -data[i][2];
-		}
-		//Particle is too high in y
-		if (data[i][1] >= half_length) {
-			data[i][1] -= 2 * (data[i][1] - half_length);
-			data[i][3] = -data[i][3];
-		}
-		//Particle is too low in y
-		if (data[i][1] <= -half_length) {
-			data[i][1] -= 2 * (data[i][1] + half_length);
-			data[i][3] = -data[i][3];
+		//This next part of the code handles the cases where a particle bounces of the walls
+		for (int d = 0; d < DIMENSION; d++) {
+			//Particle goes through a periodic boundary
+			if (periodic[d]) {
+				if (data[i][d] >= half_length)
+					data[i][d] -= 2 * half_length;
+				else if (data[i][d] < -half_length)
+					data[i][d] += 2 * half_length;
+				continue;
+			}
+			//Particle is too high along the axis d
+			if (data[i][d] >= half_length) {
+				data[i][d] -= 2 * (data[i][d] - half_length);
+				speed[d] = -speed[d];
+			}
+			//Particle is too low along the axis d
+			if (data[i][d] <= -half_length) {
+				data[i][d] -= 2 * (data[i][d] + half_length);
+				speed[d] = -speed[d];
+			}
 		}
 	}
 }
@@ -467,7 +2709,24 @@ void bouncyrandomupdate(GLfloat(* data)[8], double timestep, double half_length,
 // timestep : time intervals at which these are updated
 // maxspeed : the maximum speed that can be reached by the particles
 // kh : size of the radius of influence of a particle
+// in 3D, an update of the potential_list checks the 27 cubes of side kh+L around a particle while the other iterations only check
+// the sphere of radius kh+L, with L = n*timestep*maxspeed; the cost per iteration of a cycle of n iterations is directly minimised over n
 int compute_optimal_verlet(double timestep, double maxspeed, double kh) {
+#if DIMENSION == 3
+	double length = timestep * maxspeed;
+	double sphere = 4.0 / 3.0 * M_PI;
+	int n = 1;
+	double cost = 27 * pow(kh + length, 3);
+	// the cost first decreases with n, as the updates become rarer, then increases with the volume of the sphere
+	while (n < 1000) {
+		double next_cost = (27 + n * sphere) * pow(kh + (n + 1) * length, 3) / (n + 1);
+		if (next_cost >= cost)
+			break;
+		cost = next_cost;
+		n++;
+	}
+	return n < 2 ? -1 : n;
+#else
 	double a = -M_PI * 4 * timestep * timestep * maxspeed * maxspeed;
 
 	double b = -4 * (M_PI * timestep * kh * maxspeed - 9 * maxspeed * maxspeed * timestep * timestep);
@@ -500,28 +2759,141 @@ int compute_optimal_verlet(double timestep, double maxspeed, double kh) {
 				return floor(max_ans);
 		}
 	}
+#endif
+}
+
+particle_set* particle_set_new(int capacity) {
+	particle_set* set = malloc(sizeof(particle_set));
+	CHECK_MALLOC(set);
+	set->capacity = capacity > 0 ? capacity : 1;
+	set->data = malloc(set->capacity * sizeof(set->data[0]));
+	CHECK_MALLOC(set->data);
+	return set;
+}
+
+int particle_set_add(particle_set* set, neighborhood_options* options, const GLfloat particle[DATA_COLUMNS], double kh) {
+	neighborhood_begin_resize(options);
+	int i = options->nPoints;
+	if (i + 1 > set->capacity) {
+		set->capacity = particle_capacity(set->capacity, i + 1);
+		set->data = realloc(set->data, set->capacity * sizeof(set->data[0]));
+		CHECK_MALLOC(set->data);
+	}
+	neighborhood_reserve_particles(options, i + 1);
+	memcpy(set->data[i], particle, sizeof(set->data[0]));
+	memcpy(options->verlet_positions[i], particle, sizeof(options->verlet_positions[0]));
+	options->reorder.particle_id[i] = options->reorder.nIds++;
+	if (options->particle_kh)
+		options->particle_kh[i] = kh;
+	options->particle_origin[i] = -1;
+	options->nPoints++;
+	return i;
+}
+
+void particle_set_remove(particle_set* set, neighborhood_options* options, int i) {
+	neighborhood_begin_resize(options);
+	int last = options->nPoints - 1;
+	if (i != last) {
+		memcpy(set->data[i], set->data[last], sizeof(set->data[0]));
+		memcpy(options->verlet_positions[i], options->verlet_positions[last], sizeof(options->verlet_positions[0]));
+		options->reorder.particle_id[i] = options->reorder.particle_id[last];
+		if (options->particle_kh)
+			options->particle_kh[i] = options->particle_kh[last];
+		options->particle_origin[i] = options->particle_origin[last];
+	}
+	options->nPoints--;
+}
+
+int particle_set_remove_outside(particle_set* set, neighborhood_options* options) {
+	int nRemoved = 0;
+	// the particles are checked from the last one, so that the particle moved to the index of a removed one has already been checked
+	for (int i = options->nPoints - 1; i >= 0; i--) {
+		int is_outside = 0;
+		for (int d = 0; d < DIMENSION; d++)
+			is_outside |= !options->periodic[d] && fabs(set->data[i][d]) > options->half_length;
+		if (is_outside) {
+			particle_set_remove(set, options, i);
+			nRemoved++;
+		}
+	}
+	return nRemoved;
 }
 
-neighborhood_options* neighborhood_options_init(double timestep, double maxspeed){
+void particle_set_delete(particle_set* set) {
+	if (set) {
+		free(set->data);
+		free(set);
+	}
+}
+
+neighborhood_options* neighborhood_options_init(int nPoints, double timestep, double maxspeed){
 	neighborhood_options* options = malloc(sizeof(neighborhood_options));
 	CHECK_MALLOC(options);
 
 	int radius_algorithm = 1;
+	double target_neighbours = 21.0;
 
+	options->nPoints = nPoints;
 	options->half_length = 100;
+	for (int d = 0; d < DIMENSION; d++)
+		options->periodic[d] = 0;
 	options->use_cells = 1;
-	options->use_improved_method = 1;
+	options->use_half_stencil = 1;
+	options->use_half_lists = 0;
+	options->use_pair_changes = 0;
+	options->use_hashing = 0;
+	options->subdivision = 1;
+	options->skip_corners = 1;
+	options->use_sorted_cells = 0;
+	options->nThreads = 1;
 	options->use_verlet = 1;
 	options->optimal_verlet_steps = 0;
-	options->kh = compute_kh(radius_algorithm) * 2 * options->half_length;
+	options->use_displacement_trigger = 1;
+	options->tuner = (verlet_tuner){ 0 };
+	options->tuner.nCandidates = 5;
+	options->tuner.period = 4;
+	options->tuner.direction = 1;
+	options->tuner.factor = 1.5;
+	options->target_neighbours = target_neighbours;
+	options->use_adaptive_kh = 0;
+	options->kh_samples = 1024;
+	options->kh_tolerance = 1.5;
+	options->estimated_neighbours = 0.0;
+	options->kh = compute_kh(nPoints, target_neighbours, radius_algorithm) * 2 * options->half_length;
 	options->L = 0.0;
 	options->optimal_verlet_steps = compute_optimal_verlet(timestep, maxspeed, options->kh);
 	if (options->optimal_verlet_steps == -1)
 		options->use_verlet = 0;
 	else
 		options->L = options->optimal_verlet_steps * timestep * maxspeed;
-	options->nh = calloc(NPTS, sizeof(neighborhood));
-	CHECK_MALLOC(options->nh);
+	options->verlet_positions = calloc(nPoints, sizeof(options->verlet_positions[0]));
+	CHECK_MALLOC(options->verlet_positions);
+	options->nh = neighborhood_new(nPoints);
+	options->grid = (cell_grid){ 0 };
+	options->particle_kh = NULL;
+	options->pair_criterion = KH_MAX;
+	options->particle_level = NULL;
+	options->nLevels = 0;
+	for (int m = 0; m < MAX_LEVELS; m++)
+		options->levels[m] = (cell_grid){ 0 };
+	options->backend = BACKEND_CELLS;
+	options->tree_threshold = 8.0;
+	options->tree = (kd_tree){ 0 };
+	options->tree.leafSize = 16;
+	options->tree.max_refits = 4;
+	options->simd = SIMD_AUTO;
+	options->use_compact_lists = 0;
+	options->reorder = (morton_order){ 0 };
+	options->reorder.steps = 0;
+	options->reorder.particle_id = malloc(nPoints * sizeof(int));
+	CHECK_MALLOC(options->reorder.particle_id);
+	for (int i = 0; i < nPoints; i++)
+		options->reorder.particle_id[i] = i;
+	options->reorder.nIds = nPoints;
+	options->capacity = nPoints;
+	options->is_resized = 0;
+	options->nPrevious = nPoints;
+	options->particle_origin = NULL;
 	return options;
 }
 
@@ -530,21 +2902,31 @@ void neighborhood_options_delete(neighborhood_options* options, neighborhood* nh
 		neighborhood_delete(options->nh);
 	if (nh)
 		neighborhood_delete(nh);
-	if(options)
+	if (options) {
+		cell_grid_delete(&options->grid);
+		for (int m = 0; m < MAX_LEVELS; m++)
+			cell_grid_delete(&options->levels[m]);
+		free(options->particle_kh);
+		free(options->particle_level);
+		kd_tree_delete(&options->tree);
+		morton_order_delete(&options->reorder);
+		free(options->verlet_positions);
+		free(options->particle_origin);
 		free(options);
+	}
 }
 
-// function to check the equality of the 2 arrays of neighborhoods nh_1 and nh_2 of size nPoints
+// function to check the equality of the 2 neighborhoods nh_1 and nh_2
 int compare_neighborhoods(neighborhood* nh_1, neighborhood* nh_2) {
-	for (int i = 0; i < NPTS; i++) {
-		if (nh_1[i].nNeighbours != nh_2[i].nNeighbours)
+	neighbours* list_1 = &nh_1->list;
+	neighbours* list_2 = &nh_2->list;
+	for (int i = 0; i < nh_1->nPoints; i++) {
+		if (list_1->start[i + 1] - list_1->start[i] != list_2->start[i + 1] - list_2->start[i])
 			return 0;
-		neighbours* current = NULL;
-		for (current = nh_1[i].list; current; current = current->next) {
+		for (int k = list_1->start[i]; k < list_1->start[i + 1]; k++) {
 			int is_equal = 0;
-			neighbours* temp = NULL;
-			for (temp = nh_2[i].list; temp && !is_equal; temp = temp->next) {
-				is_equal = current->index == temp->index;
+			for (int l = list_2->start[i]; l < list_2->start[i + 1] && !is_equal; l++) {
+				is_equal = list_1->index[k] == list_2->index[l];
 			}
 			if (!is_equal) {
 				return 0;
@@ -5,89 +5,575 @@
 #include <time.h>
 #include <math.h>
 
-extern int NPTS;
-
 // see stringification process
 #define xstr(s) str(s)
 #define str(s) #s
 #define M_PI 3.14159265358979323846
 
+// dimension of the simulation, chosen at compile time with -DDIMENSION=3; the search is built in 2D by default
+#ifndef DIMENSION
+#define DIMENSION 2
+#endif
+
+// number of columns of the data table : DIMENSION positions, DIMENSION speeds, 3 colors and the transparency
+#define DATA_COLUMNS (2 * DIMENSION + 4)
+
+// number of cells around a cell, itself included, that may contain the neighbours of its particles, when the cells are as wide as the search radius
+#if DIMENSION == 3
+#define STENCIL_SIZE 27
+#else
+#define STENCIL_SIZE 9
+#endif
+
+// largest number of cells per search radius, see neighborhood_options, and number of cells of the matching stencil of 7x7 (7x7x7) cells
+#define MAX_SUBDIVISION 3
+#if DIMENSION == 3
+#define MAX_STENCIL_SIZE 343
+#else
+#define MAX_STENCIL_SIZE 49
+#endif
+
+// maximum number of levels of cells used when every particle has its own radius, see neighborhood_options
+#define MAX_LEVELS 16
+
+// number of particles of a cell tested at once by the distance filter of the cell searches, see cell_grid_filter
+#define FILTER_CHUNK 256
+
+// number of particles from which the particles are sorted into the cells by several threads, see cell_grid_sort
+#ifndef PARALLEL_SORT_MIN
+#define PARALLEL_SORT_MIN 16384
+#endif
+
+// number of floats added after the coordinates of each axis in cellPositions, so that the vector loads can read past the last particle
+#define SIMD_PADDING 16
+
 // malloc verification
 // To use after each call to malloc, calloc and realloc
 #define CHECK_MALLOC(ptr) if((ptr)==NULL) { \
 		BOV_ERROR_LOG(BOV_OUT_OF_MEM_ERROR, "Memory allocation failed"); \
 		exit(EXIT_FAILURE); }
 
-// Structure to represent a neighbours, which is a node of the neighborhoods linked lists
-// index : the index in the data table, supposed to be available everywhere it is needed
-// distance : distance between the particle at the index in data and the particle that owns the neighborhood
-// next : pointer to the next neighbours of the linked list
+// Structure to represent the neighbours of every particle as a compressed sparse row (CSR) table
+// nRows : number of rows of the table, one per particle
+// rowCapacity : number of rows that start can contain without any reallocation
+// size : number of neighbours currently stored in the table
+// capacity : number of neighbours that can be stored in index, distance and displacement without any reallocation
+// start : array of size nRows+1; the neighbours of the particle i are stored from start[i] to start[i+1]-1
+// index : the index in the data table of each neighbour, supposed to be available everywhere it is needed
+// distance : distance between each neighbour and the particle that owns the row
+// displacement : position of each neighbour minus the position of the particle that owns the row, taken between their closest images
+// along the periodic axes, so that the operators on the neighbours do not have to gather their positions again
 typedef struct neighbours {
-	int index;
-	double distance;
-	struct neighbours* next;
+	int nRows;
+	int rowCapacity;
+	int size;
+	int capacity;
+	int* start;
+	int* index;
+	double* distance;
+	double(*displacement)[DIMENSION];
 }neighbours;
 
-// Structure to represent the neighborhood of a particle
-// index : the index in the data table, supposed to be available everywhere it is needed
-// nNeighbours : number of neighbours in the linked list list
-// nPotentialNeighbours : number of neighbours in the linked list potential_list, which contains the points to be checked in the verlet algorithm
-// list : linked list of the actual neighbours of the particle at the index index in the data table
-// potential_list : only list to be checked when we look for neighbours in the verlet algorithm
+// Structure to represent the pairs of particles found by the search, before they are sorted into a neighbours table
+// size : number of pairs currently stored
+// capacity : number of pairs that can be stored without any reallocation
+// owner : index of the particle that owns the neighbour
+// index : index of the neighbour
+// distance : distance between the owner and the neighbour
+// displacement : position of the neighbour minus the position of the owner
+typedef struct neighbour_pairs {
+	int size;
+	int capacity;
+	int* owner;
+	int* index;
+	double* distance;
+	double(*displacement)[DIMENSION];
+}neighbour_pairs;
+
+// value of the words of a compact_neighbours table announcing a neighbour whose index is stored in the two next words
+#define COMPACT_ESCAPE (-32768)
+
+// Structure to represent a neighbours table in a compact form, with 2 bytes per neighbour instead of the 4+8+8*DIMENSION bytes of a neighbours table
+// the index of each neighbour is stored as its difference with the index of the particle that owns the row, which is small once the particles
+// are sorted along a Morton curve by neighborhood_reorder; the other ones are stored as COMPACT_ESCAPE followed by the two halves of their index
+// nRows : number of rows of the table, one per particle
+// size : number of neighbours currently stored in the table
+// nWords : number of words currently stored in words
+// wordCapacity : number of words that can be stored in words without any reallocation
+// distanceCapacity : number of neighbours that can be stored in distance without any reallocation
+// start : array of size nRows+1; the neighbours of the particle i are the neighbours from start[i] to start[i+1]-1
+// wordStart : array of size nRows+1; the neighbours of the particle i are stored in the words from wordStart[i] to wordStart[i+1]-1
+// words : differences of index of the neighbours, read by compact_neighbours_decode
+// distance : distance between each neighbour and the particle that owns the row in single precision, NULL when they are not stored
+typedef struct compact_neighbours {
+	int nRows;
+	int size;
+	int nWords;
+	int wordCapacity;
+	int distanceCapacity;
+	int* start;
+	int* wordStart;
+	short* words;
+	float* distance;
+}compact_neighbours;
+
+// Structure to represent the neighborhoods of all the particles; every array is kept from one iteration to the next one
+// nPoints : number of particles, and so number of rows of the tables
+// list : table of the actual neighbours of the particles
+// potential_list : only table to be checked when we look for neighbours in the verlet algorithm
+// list_pairs : pairs found during the current iteration, to be sorted into list
+// potential_pairs : pairs found during the current iteration, to be sorted into potential_list
+// is_half : int used as a boolean; the potential_list only contains each pair once, in the row of one of its particles
+// nThreads : number of threads that have their own pairs
+// thread_list_pairs : pairs found by each thread during the current iteration, to be merged into list
+// thread_potential_pairs : pairs found by each thread during the current iteration, to be merged into potential_list
+// is_compact : int used as a boolean; the potential_list is stored in compact_potential instead, and its own arrays are freed
+// half_list : table of the actual neighbours with each pair only once, in the row of one of its particles, filled instead of list when
+//             options->use_half_lists is set; list is then only filled by neighborhood_transpose
+// compact_potential : compact form of the potential_list, kept between two searches when options->use_compact_lists is set
+// pair_list : table of the actual neighbours of the previous iteration with each pair only once, in the row of its particle of smaller index,
+//             every row being sorted by index; only filled when options->use_pair_changes is set
+// pair_buffer : table filled in the same way with the pairs of the current iteration, then swapped with pair_list
+// added_pairs : pairs that became neighbours during the last iteration, with their particle of smaller index as owner, sorted by owner then index
+// removed_pairs : pairs that are no longer neighbours since the last iteration, sorted in the same way, with their distance and displacement
+//                 of the previous iteration
+// countCapacity : number of counters that can be stored in threadCounts without any reallocation
+// threadCounts : number of pairs of each thread in each row of the list, then position of its next pair in the row, for neighborhood_transpose
+// sumCapacity : number of values that can be stored in sums without any reallocation
+// sums : values accumulated over the neighbours of the particles by the kernels, see neighborhood_sums_reserve
 typedef struct neighborhood {
-	int index;
-	int nNeighbours;
-	int nPotentialNeighbours;
-	neighbours* list;
-	neighbours* potential_list;
+	int nPoints;
+	neighbours list;
+	neighbours potential_list;
+	neighbour_pairs list_pairs;
+	neighbour_pairs potential_pairs;
+	int is_half;
+	int nThreads;
+	neighbour_pairs* thread_list_pairs;
+	neighbour_pairs* thread_potential_pairs;
+	int is_compact;
+	compact_neighbours compact_potential;
+	neighbours half_list;
+	neighbours pair_list;
+	neighbours pair_buffer;
+	neighbour_pairs added_pairs;
+	neighbour_pairs removed_pairs;
+	size_t countCapacity;
+	int* threadCounts;
+	size_t sumCapacity;
+	double* sums;
 }neighborhood;
 
-// Structure to be passed as argument to the function loop_without_drawing, now basically the same as the loop_arg_with_drawing without some useless parameters
-// cells : array of size (size*size) that contains the cells of type cell
-// cellCounter : counter to inform how many cells are and have been read already
-// nPoints : number of points in the simulation
-// iterations : used in the verlet algorithm; is equal to 0 each time we need to update the potential_list of the neighborhoods
-// size : number of cells in a row
+// Structure to represent the cells of the simulation, filled with a counting sort of the particles and kept from one iteration to the next one
+// the cells are either those of a square grid of the domain, or only the occupied ones, found with a hash table of their coordinates
+// the cells are 1/subdivision of the search radius wide, so that the neighbours of a particle are in the cells at most subdivision cells away from its own one
+// the square grid is surrounded by subdivision layers of empty ghost cells, so that the cell (x,y) has the number (y+r)*stride + x+r, r being subdivision,
+// and the cell (x,y,z) of the cubic grid of the 3D build has the number ((z+r)*stride + y+r)*stride + x+r
+// the occupied cells are numbered in the order they are found; the number nOccupied is an empty cell, used for the missing neighbours
+// along the periodic axes, the stencil of the square grid wraps around the domain, so that the neighbours of every cell are stored in
+// cellNeighbours as with the hash table; a neighbour found twice, when the grid has less than 3 cells along such an axis, is replaced by the empty ghost cell 0
+// is_hashed : int used as a boolean to inform if only the occupied cells are stored
+// is_wrapped : int used as a boolean to inform if the square grid uses cellNeighbours, built for the axes given by periodic
+// subdivision : number of cells per search radius, from 1 to MAX_SUBDIVISION
+// nStencil : number of cells of the full stencil, (2*subdivision+1)^DIMENSION, and so of the neighbours of each cell in cellNeighbours
+// skip_corners : int used as a boolean; the cells of the stencil that are entirely farther than the search radius from the cell are left out, set by the search
+// size : number of cells in a row of the square grid, ghost cells excluded, so there are size^DIMENSION cells containing particles
+// stride : number of cells in a row of the square grid, ghost cells included
+// width : length of the side of the cells, only used with the hash table
+// nActive : number of cells that can contain particles, ghost cells included
+// nCells : number of cells that can be stored in cellStart without any reallocation
+// nPoints : number of particles that can be stored in cellParticles and cellNumber
+// nParticles : number of particles of the simulation at the last fill, all of them having a cellNumber
+// cellStart : array of size (nActive+1), (nOccupied+2) with the hash table; the particles contained in the cell c are stored from cellStart[c] to cellStart[c+1]-1 in cellParticles
+// cellParticles : index of the particles in the data table, sorted by cell
+// cellNumber : number of the cell that contains each particle, -1 for the particles left out of the grid, such as the ones of the other levels, see neighborhood_options
+// nOccupied : number of occupied cells found with the hash table
+// occupiedCapacity : number of cells that can be stored in cellCoords and cellNeighbours without any reallocation
+// cellCoords : coordinates of each occupied cell, in number of cells from the origin
+// cellNeighbours : numbers of the nStencil cells around each occupied cell, or each cell of the wrapped grid, sorted by z, y then x; the cell itself is the one in the middle
+// hashCapacity : number of slots of the hash table, a power of 2 at least twice larger than nOccupied
+// hashCells : number of the occupied cell stored in each slot of the hash table, -1 for an empty slot
+// nThreads : number of threads used to sort the particles into the cells, set by the search; the sort is serial for 1 or without OpenMP
+// countCapacity : number of counters that can be stored in threadCounts without any reallocation
+// threadCounts : number of particles of each thread in each cell, then position of its next particle in the cell, for the parallel sort
+// is_sorted : int used as a boolean; the particles of each cell are sorted by their key, their first coordinate, set by the search
+// nOrdered : number of particles in cellParticles at the end of the last sort, whose order is used as the starting order of the next one;
+//            the next sort starts from the order of the indices instead when it differs from nParticles, so it must be set to 0 when the particles are renumbered
+// previousParticles : cellParticles of the previous sort, swapped with cellParticles by each sort of the sorted grid
+// cellKeys : key of each particle in the order of cellParticles, its first coordinate brought back inside the domain along a periodic axis
+// positionStride : number of floats of each axis in cellPositions, padding included
+// cellPositions : coordinates of the particles in the order of cellParticles, axis by axis, so that the ones of a cell are contiguous:
+//                 the coordinate d of cellParticles[b] is cellPositions[d*positionStride + b]; only filled by cell_grid_gather
+typedef struct cell_grid {
+	int is_hashed;
+	int is_wrapped;
+	int subdivision;
+	int nStencil;
+	int skip_corners;
+	int periodic[DIMENSION];
+	int size;
+	int stride;
+	double width;
+	int nActive;
+	int nCells;
+	int nPoints;
+	int nParticles;
+	int* cellStart;
+	int* cellParticles;
+	int* cellNumber;
+	int nOccupied;
+	int occupiedCapacity;
+	int(*cellCoords)[DIMENSION];
+	int* cellNeighbours;
+	int hashCapacity;
+	int* hashCells;
+	int nThreads;
+	size_t countCapacity;
+	int* threadCounts;
+	int is_sorted;
+	int nOrdered;
+	int* previousParticles;
+	GLfloat* cellKeys;
+	int positionStride;
+	GLfloat* cellPositions;
+}cell_grid;
+
+// Structure to represent the reordering of the particles along a Morton curve (Z-curve) of their cells, so that particles close in space are close in memory
+// steps : number of iterations between two reorderings; 0 means the particles are never reordered
+// nPoints : number of particles that can be stored in the arrays
+// nCodes : number of occupied cells, ranked along the Morton curve, that can be counted in codeStart
+// particle_id : stable identifier of the particle stored at each index of the data table; particle_id[i] == i before the first reordering
+// nIds : number of identifiers given so far; the particles added by particle_set_add get the next ones
+// order : last permutation applied; the particle now stored at the index i was stored at the index order[i] before the reordering
+// slot : inverse of order; the particle stored at the index i before the reordering is now stored at the index slot[i]
+// codeStart : array of size (nCodes+1) used for the counting sort of the Morton codes
+// buffer : copy of the data table used to apply the permutation
+// nCellCodes : number of occupied cells that can be stored in cellCodes
+// cellCodes : Morton code and number of each occupied cell, sorted to rank the cells
+typedef struct morton_order {
+	int steps;
+	int nPoints;
+	int nCodes;
+	int* particle_id;
+	int nIds;
+	int* order;
+	int* slot;
+	int* codeStart;
+	GLfloat(*buffer)[DATA_COLUMNS];
+	int nCellCodes;
+	unsigned long long(*cellCodes)[2];
+}morton_order;
+
+// Structure to represent the autotuning of the length L of the verlet algorithm, chosen from the measured cost of the iterations
+// the first nCandidates updates of the potential_list each try a length around the one of the analytic model; the cheapest one is then kept
+// and, every period updates, a length factor times smaller or larger is tried again to follow the changes of the simulation
+// use_autotune : int used as a boolean to inform if L is tuned or not; the potential_list is then updated with the displacement trigger
+// nCandidates : number of lengths tried at the beginning of the simulation
+// candidate : number of lengths already tried; the exploration is over when candidate == nCandidates
+// period : number of updates of the potential_list between two tries of a new length
+// cycles : number of updates of the potential_list since the last try
+// probing : int used as a boolean to inform if the current length is being tried
+// direction : 1 if the next length to be tried is larger than the best one, -1 if it is smaller
+// factor : ratio between two lengths to be tried
+// reference_L : length given by the analytic model
+// best_L : cheapest length found so far
+// best_cost : measured time of one iteration with best_L, in seconds
+// cycle_time : time spent in the neighborhood search since the last update of the potential_list, in seconds
+// cycle_steps : number of iterations since the last update of the potential_list
+typedef struct verlet_tuner {
+	int use_autotune;
+	int nCandidates;
+	int candidate;
+	int period;
+	int cycles;
+	int probing;
+	int direction;
+	double factor;
+	double reference_L;
+	double best_L;
+	double best_cost;
+	double cycle_time;
+	int cycle_steps;
+}verlet_tuner;
+
+// Structure to represent a kd-tree of the particles, used instead of the cells when the particles are clustered
+// the tree is balanced: each node splits its particles in two halves along the longest side of its box, so that the children of the node k
+// are the nodes 2k+1 and 2k+2 and all the leaves are at the same depth; between two builds, the boxes are only refitted to the new positions
+// is_active : int used as a boolean to inform if the last search used the tree
+// nPoints : number of particles that can be stored in treeParticles
+// depth : number of levels of nodes below the root; the leaves are the nodes from 2^depth-1 to nNodes-1
+// nNodes : number of nodes of the tree, 2^(depth+1)-1
+// nodeCapacity : number of nodes that can be stored without any reallocation
+// leafSize : maximum number of particles in a leaf
+// refits : number of refits since the last build
+// max_refits : number of searches refitting the tree between two builds; 0 means that the tree is built at each search
+// treeParticles : index of the particles, sorted so that the particles of each node are contiguous
+// nodeBegin, nodeEnd : the particles of the node k are stored from nodeBegin[k] to nodeEnd[k]-1 in treeParticles
+// lower, upper : corners of the box of the particles of each node
+// nodeKh : largest radius of the particles of each node, only used when every particle has its own radius
+typedef struct kd_tree {
+	int is_active;
+	int nPoints;
+	int depth;
+	int nNodes;
+	int nodeCapacity;
+	int leafSize;
+	int refits;
+	int max_refits;
+	int* treeParticles;
+	int* nodeBegin;
+	int* nodeEnd;
+	GLfloat(*lower)[DIMENSION];
+	GLfloat(*upper)[DIMENSION];
+	double* nodeKh;
+}kd_tree;
+
+// backend used by the search to find the potential neighbours of the particles
+// with BACKEND_AUTO, the cells are filled and the tree is used instead when their occupancy varies too much, see neighborhood_options
+typedef enum search_backend {
+	BACKEND_CELLS,
+	BACKEND_TREE,
+	BACKEND_AUTO
+}search_backend;
+
+// instructions used by the cell searches to test the distances between a particle and the particles of a cell, see cell_grid_filter
+// SIMD_OFF skips the filter, the other levels test blocks of particles with 1, 8 or 16 lanes; SIMD_AUTO uses the best level supported by the processor
+typedef enum simd_level {
+	SIMD_OFF,
+	SIMD_SCALAR,
+	SIMD_AVX2,
+	SIMD_AVX512,
+	SIMD_AUTO
+}simd_level;
+
+// criterion used to combine the radii of two particles into the radius of their pair, when every particle has its own radius
+// the pair is only made of neighbours if their distance is smaller than this radius, which is the same for both particles
+typedef enum kh_criterion {
+	KH_MAX,
+	KH_MEAN
+}kh_criterion;
+
+// Structure of the options of a search, created by neighborhood_options_init and given to neighborhood_update with the table of the particles
+// nPoints : number of points in the simulation, changed by particle_set_add and particle_set_remove; every instance of the search has its own
+//           options, so that several simulations can run at the same time in one process, each one in its own thread
 // nh : list of the neighborhoods to be filled; there are nPoints neighborhoods
-// kh : size of the radius of the influence circle of a particle
+// kh : size of the radius of the influence circle of a particle; first chosen for target_neighbours particles uniformly distributed in the domain
+// target_neighbours : mean number of neighbours wanted for each particle, from which kh is chosen
+// use_adaptive_kh : int used as a boolean; before the first search and after each search, the mean number of neighbours given by kh is estimated
+//                   from the occupancy of the cells of kh_samples particles, and kh is changed to the one giving target_neighbours neighbours when
+//                   the estimate is more than kh_tolerance times the target, or less than the target over kh_tolerance; the search is then done
+//                   again with this kh; only used when every particle uses kh, that is without particle_kh
+// kh_samples : number of particles whose cell occupancy is used by the estimate
+// kh_tolerance : largest ratio, larger than 1, between the estimated number of neighbours and target_neighbours, or its inverse, that leaves kh unchanged
+// estimated_neighbours : mean number of neighbours given by the kh of the last estimate, before it was changed, 0 before the first one
 // L : distance to be added to kh in the verlet algorithm; potential neighbours are the ones inside of a circle of radius kh+L
-// coord : matrix of nPoints row and 2 column representing the positions of the particles used to draw; coord[i][0] == data[i][0] && coord[i][1] == data[i][1]
-// data : matrix of nPoints row and 8 column representing the positions, speed, color and transparency of a particle
 // use_verlet : int used as a boolean to inform if the verlet algorithm is used or not
 // use_cells : int used as a boolean to inform if the cells are used or not
-// use_improved_method : int used as a boolean to inform if the improved algorithm is used or not
+// use_half_stencil : int used as a boolean; each particle only checks its own cell and the 4 cells after it (13 in 3D), and each pair found is added to both particles
+// use_hashing : int used as a boolean; only the occupied cells are stored, found with a hash table, so that the particles do not have to stay in the domain of size half_length
+//               the square grid is used anyway when an axis is periodic, since the domain is then bounded
+// subdivision : number of cells per search radius kh+L, from 1 to MAX_SUBDIVISION; with 2 or 3, the cells are kh+L over 2 or 3 wide and the particles
+//               check the 5x5 or 7x7 cells around their own one (5x5x5 or 7x7x7 in 3D), which cover a smaller area around the circle than 3x3 wide cells
+// skip_corners : int used as a boolean; the cells of the stencil that are entirely outside of the circle of radius kh+L are not checked,
+//                which only leaves cells out when subdivision is large enough for the corners of the stencil to be that far
+// use_sorted_cells : int used as a boolean; the particles of each cell are kept sorted by x, so that the searches only check the particles of the
+//                    neighbouring cells whose x is within kh+L of the one of the particle (sweep and prune), which pays off with crowded cells
+// periodic : int used as a boolean for each axis; the domain is periodic along this axis, so that the distances are the ones to the closest image
+//            of the particles and the particles leaving the domain come back on the other side; kh+L must not exceed half_length along these axes
+// nThreads : number of threads of the neighborhood search; 1 means the serial algorithm, more is only available when compiled with OpenMP
+// grid : cells of the simulation, kept from one iteration to the next one
+// particle_kh : radius of the influence circle of each particle, set by the user; NULL means that every particle uses kh
+//               the array is permuted by the reordering and freed by neighborhood_options_delete
+// pair_criterion : combination of the radii of two particles giving the radius of their pair, KH_MAX or KH_MEAN
+// particle_level : level of the cells containing each particle, found by the search with particle_kh
+// nLevels : number of levels of cells used by the last search with particle_kh; the cells of the level m are 2^m times wider than the ones of the level 0,
+//           so that the particles only check the cells of their own level and of the coarser ones, see neighborhood_search_levels
+// levels : cells of each level, only containing the particles of this level, kept from one iteration to the next one
+// backend : backend of the search, BACKEND_CELLS, BACKEND_TREE or BACKEND_AUTO
+// tree_threshold : with BACKEND_AUTO, the tree is used when the mean number of other particles in the cell of a particle is more than tree_threshold
+//                  times the mean number of particles in a cell, that is when 1 + (variance of the occupancy - mean occupancy)/(mean occupancy)^2 > tree_threshold
+// tree : kd-tree of the particles, kept from one iteration to the next one
+// simd : instructions of the distance filter of the cell searches; a level that is not supported by the processor is replaced by the best supported one
+// use_half_lists : int used as a boolean; the search and the verlet algorithm only fill the half_list of the neighborhoods, each row being filled
+//                  by a single thread, and the list is empty until neighborhood_transpose is called
+// use_pair_changes : int used as a boolean; every update also fills the added_pairs and removed_pairs of the neighborhoods
+// use_compact_lists : int used as a boolean; between two searches of the verlet algorithm, the potential_list is only kept in the compact form
+//                     of a compact_neighbours table, which is meant to be used with the reordering of the particles
+// reorder : reordering of the particles along a Morton curve, done every reorder.steps iterations
+// capacity : number of particles that can be stored in verlet_positions, reorder.particle_id, particle_kh, particle_level and particle_origin
+//            without any reallocation
+// is_resized : int used as a boolean; some particles were added or removed by a particle_set since the last update
+// nPrevious : number of particles at the last update, whose indices are the ones of the neighborhoods until the next one
+// particle_origin : index at the last update of the particle now stored at each index, -1 for the particles added since then; only valid with is_resized
 typedef struct neighborhood_options {
+	int nPoints;
 	double kh;
+	double target_neighbours;
+	int use_adaptive_kh;
+	int kh_samples;
+	double kh_tolerance;
+	double estimated_neighbours;
 	double L;
 	int use_verlet;
 	int use_cells;
-	int use_improved_method;
+	int use_half_stencil;
+	int use_hashing;
+	int subdivision;
+	int skip_corners;
+	int use_sorted_cells;
+	int nThreads;
 	int half_length;
+	int periodic[DIMENSION];
 	int optimal_verlet_steps;
+	int use_displacement_trigger;
+	GLfloat(*verlet_positions)[DIMENSION];
+	verlet_tuner tuner;
 	neighborhood* nh;
+	cell_grid grid;
+	double* particle_kh;
+	kh_criterion pair_criterion;
+	int* particle_level;
+	int nLevels;
+	cell_grid levels[MAX_LEVELS];
+	search_backend backend;
+	double tree_threshold;
+	kd_tree tree;
+	simd_level simd;
+	int use_half_lists;
+	int use_pair_changes;
+	int use_compact_lists;
+	morton_order reorder;
+	int capacity;
+	int is_resized;
+	int nPrevious;
+	int* particle_origin;
 }neighborhood_options;
 
+// Structure to represent particles whose number changes during the simulation, such as the ones of an inlet and an outlet
+// the options->nPoints particles are stored at the beginning of data without any hole: a removed particle is replaced by the last one, so that
+// adding or removing a particle takes a constant time, and the arrays are only reallocated when their capacity is doubled
+// the search is told about the particles added and removed, and brings its own structures up to date at the next call to neighborhood_update
+// capacity : number of particles that can be stored in data without any reallocation
+// data : table of the positions, speeds, colors and transparency of the particles, to be given to neighborhood_update
+typedef struct particle_set {
+	int capacity;
+	GLfloat(*data)[DATA_COLUMNS];
+}particle_set;
+
 // function used to print neighborhoods
-// nh : array of neighborhoods to be printed
+// nh : neighborhoods to be printed
 // data : table of the data's of the particles
-// size : number of particles in the simulation
-void printNeighborhood(neighborhood* nh, GLfloat(* data)[8]);
+void printNeighborhood(neighborhood* nh, GLfloat(* data)[DATA_COLUMNS]);
 
 // function that basically fills the neighborhoods of the particles of one iteration, with the arguments args of type loop_arg
-void neighborhood_update(neighborhood_options* options, neighborhood* nh, GLfloat(* data)[8], int iterations);
+void neighborhood_update(neighborhood_options* options, neighborhood* nh, GLfloat(* data)[DATA_COLUMNS], int iterations);
+
+// function that returns the wall-clock time in seconds
+double wall_time();
+
+// function that returns a pseudo-random number between 0 and 1 and moves seed to the next state of the generator
+double random_uniform(unsigned int* seed);
 
 // function to change the particles velocities randomly and updates the positions based, we assume elastic collisions with boundaries
 // data : table that contains the informations of the particles of the simulation
+// nPoints : number of particles in data
 // coord : table that contains the positions of the particles of the simulations used to draw
 // timestep : time intervals at which these are updated
 // xmin,xmax,ymin,ymax : boundaries of the domain
 // maxspeed : the maximum speed that can be reached by the particles
-void bouncyrandomupdate(GLfloat(* data)[8], double timestep, double half_length, double maxspeed);
+// periodic : int used as a boolean for each axis; along a periodic axis, the particles leaving the domain come back on the other side instead of bouncing
+// seed : state of the random generator of the simulation, so that the simulations running at the same time do not share one
+void bouncyrandomupdate(GLfloat(* data)[DATA_COLUMNS], int nPoints, double timestep, double half_length, double maxspeed, const int periodic[DIMENSION], unsigned int* seed);
 
-neighborhood_options* neighborhood_options_init(double timestep, double maxspeed);
+// function to create the options of a simulation of nPoints particles, with its own neighborhoods, cells and buffers
+neighborhood_options* neighborhood_options_init(int nPoints, double timestep, double maxspeed);
 
 void neighborhood_options_delete(neighborhood_options* options, neighborhood* nh);
 
 int compare_neighborhoods(neighborhood* nh_1, neighborhood* nh_2);
 
+// function to sort the particles in data along a Morton curve of the cells of options->grid;
+// the neighborhoods nh are renumbered accordingly and options->reorder.particle_id keeps track of the stable identifier of each particle
+void neighborhood_reorder(neighborhood_options* options, neighborhood* nh, GLfloat(* data)[DATA_COLUMNS]);
+
+// function that finds the particles around nProbes points that may be anywhere, such as sensors or the nodes of an export grid,
+// with the cells or the kd-tree of the last call to neighborhood_update, which are not built again
+// probe_nh : neighborhoods created by neighborhood_new, whose list gets one row per probe; the displacements go from the probe to the particle
+// probes : positions of the probes
+// a particle is a neighbour of a probe when their distance is smaller than options->kh, or than its own radius when every particle has one
+void neighborhood_probe(neighborhood_options* options, neighborhood* probe_nh, GLfloat(* data)[DATA_COLUMNS], GLfloat(* probes)[DIMENSION], int nProbes);
+
+// function called by neighborhood_visit for each pair of neighbours (i,j)
+// context : pointer given to neighborhood_visit, to the values to be computed
+// distance : distance between the particles
+// displacement : position of j minus the position of i, between their closest images along the periodic axes
+typedef void (*pair_visitor)(void* context, int i, int j, double distance, const double displacement[DIMENSION]);
+
+// function that calls visit for each pair of neighbours, in both orders, without building any neighbours table, so that an operator used once
+// only needs memory for its own values; the calls for the particle i are all made by the same thread, so that visit may only update the values of i
+void neighborhood_visit(neighborhood_options* options, GLfloat(* data)[DATA_COLUMNS], pair_visitor visit, void* context);
+
+// function to fill the compact table c with the neighbours table n, whose distances are only kept when keep_distance is set
+void compact_neighbours_build(compact_neighbours* c, neighbours* n, int keep_distance);
+
+// function that returns the neighbour of owner stored in words at *position, and moves position to the next neighbour
+// the neighbours of the row i are read by starting at position c->wordStart[i] and calling this function c->start[i+1]-c->start[i] times
+int compact_neighbours_decode(const short* words, int* position, int owner);
+
+// function to properly free the arrays of the compact table c
+void compact_neighbours_delete(compact_neighbours* c);
+
+// function that returns the number of threads to be used by the neighborhood search, always 1 without OpenMP
+int neighborhood_threads(neighborhood_options* options);
+
+// function that returns the radius within which the particles i and j are neighbours: kh, or the combination of their own radii
+// given by options->pair_criterion when every particle has its own radius
+double pair_kh(neighborhood_options* options, int i, int j);
+
+// function that fills the list of nh with both directions of each pair of its half_list, the rows being shared between nThreads threads
+// the row i gets its own neighbours of the half_list first, in the same order, then the particles having i in their row, sorted by index
+void neighborhood_transpose(neighborhood* nh, int nThreads);
+
+// function that fills n with each pair of the table source once, in the row of its particle of smaller index, every row being sorted by index
+// is_half : int used as a boolean; source only contains each pair once, otherwise it contains both directions of each pair
+// p : empty pairs used as a buffer
+// n and source may be the same table
+void neighbours_sort_pairs(neighbours* n, neighbours* source, int is_half, neighbour_pairs* p);
+
+// function that fills the added_pairs and removed_pairs of nh by comparing its pair_list with the actual neighbours of source, then keeps them in pair_list
+// is_half : int used as a boolean; source only contains each pair once, as the half_list, otherwise it contains both directions of each pair
+void neighborhood_changes(neighborhood* nh, neighbours* source, int is_half);
+
+// function that returns the best level of instructions of the distance filter supported by the processor
+simd_level neighborhood_simd_supported();
+
+// function to create the neighborhoods of nPoints particles, with empty tables
+neighborhood* neighborhood_new(int nPoints);
+
+// function that returns the sums of nh, able to contain nSums values; they are only reallocated when they are too small, so that the
+// kernels do not allocate their accumulators at every call, and their values are left to the caller
+double* neighborhood_sums_reserve(neighborhood* nh, size_t nSums);
+
+// function to create a set able to contain capacity particles without any reallocation, whose options->nPoints first particles are to be filled by the caller
+particle_set* particle_set_new(int capacity);
+
+// function that adds a particle at the end of set, at the index options->nPoints which is then incremented, and returns this index
+// particle : positions, speeds, colors and transparency of the new particle
+// kh : radius of the influence circle of the new particle, only used when options->particle_kh is set
+int particle_set_add(particle_set* set, neighborhood_options* options, const GLfloat particle[DATA_COLUMNS], double kh);
+
+// function that removes the particle i from set by moving the last particle to its index, then decrements options->nPoints
+// the neighbours of the removed particle are dropped by the next update, and its pairs are not reported in the removed_pairs
+void particle_set_remove(particle_set* set, neighborhood_options* options, int i);
+
+// function that removes the particles that left the domain of size options->half_length along an axis that is not periodic, as through an outlet,
+// and returns their number
+int particle_set_remove_outside(particle_set* set, neighborhood_options* options);
+
+// function to properly delete the set of particles
+void particle_set_delete(particle_set* set);
+
+// function to properly delete the neighborhoods nh
+void neighborhood_delete(neighborhood* nh);
+
 #endif